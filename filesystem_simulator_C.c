@@ -12,7 +12,8 @@
  *  mkdir <name>                :   make a subdirectory
  *  rndir <old_name> <new_name> :   rename directory <old_name> to <new_name>
  *  cd <path>                   :   change directory to path
- *  rmdir <name>                :   remove/delete directory <name>
+ *  rmdir <name> [defer]        :   remove/delete directory <name>
+                        (with defer the directory is only unlinked; its blocks are freed by reclaim)
  *  mvdir <name> <path>         :   move directory <name> to the location <path> (removing original one)
                         (or rename <name> to <path> at same location)
  *  mkfil <name> <size>         :   make file <name> with size <size>
@@ -21,21 +22,114 @@
  *  rmfil <name>                :   remove/delete file <name>
  *  mvfil <name> <path>         :   move file <name> to the location <path> (removing original one)
                         (or rename <name> to <path> at same location)
- *  exit                        :   terminate the program 
+ *  write <name> <data>         :   replace contents of file <name> with <data> (the file is created if needed)
+ *  append <name> <data>        :   add <data> at the end of file <name> (the file is created if needed)
+ *  cat <name>                  :   print contents of file <name>
+ *  sync                        :   commit pending changes to the journal and write them back to the image
+ *  group [<n>]                 :   commit journal every <n> commands (1 makes every command durable at once)
+ *  reclaim                     :   free blocks of directories removed with rmdir <name> defer
+ *  fsck [repair]               :   check that superblock, folders and files agree (and repair what does not)
+ *  dcache                      :   print hit/miss counters of path resolution cache
+ *  snapshot [<name> [drop]]    :   keep the state of the disk as snapshot <name> (or drop it; without <name> list snapshots)
+ *  restore <name>              :   bring the disk back to the state kept as snapshot <name>
+ *  stats [reset]               :   print latency percentiles of each command and counters of block operations (or zero them)
+ *  bench dir <n>               :   time mkfil and existence check while a new directory grows to <n> items
+ *  bench io <kb>               :   time sequential and random reads and writes of a <kb> KB file
+ *  bench journal <n>           :   time <n> mkfil/rmfil pairs committing every command and in groups
+ *  bench ops <n>               :   time each command function on <n> names with blocks allocated and bytes changed per call
+ *  bench scale <n>             :   time operations as the disk fills, as a directory grows to <n> items and as a path
+                        grows to <n> directories
+ *  bench trace <file>          :   replay commands of <file> and report time, blocks and bytes per command
+ *  bench threads <n>           :   run <n> ls/mkfil/cd commands in each of 1 to 32 sessions at once and report throughput
+ *  source <file>               :   run commands from <file> in batch mode
+ *  exit                        :   terminate the program (or end the session of a connection)
+ *
+ *  usage: filesystem_simulator_C [-b] [-p <bytes>] [-s <bytes>] [-n <length>] [-t <file>] [-l <socket> [-w <n>]] [image]
+ *         filesystem_simulator_C -c <socket> [-k <n>] [-q <n>] [-t <file>] < <script>
+ *      with -b commands are run in batch mode: no prompts, buffered output, an existing file is edited by mkfil
+ *      without asking, and number of commands, errors and elapsed time are printed at the end
+ *      with <image> the disk is kept in that file; it is formatted on first use and mounted afterwards
+ *      changes reach the image only through the journal <image>.journal, which is replayed on mount
+ *      without <image> the disk lives in memory and is lost at exit
+ *      -p, -s and -n set size of the disk, size of a block (a multiple of 8) and longest name when a disk is formatted
+ *      (e.g. -p 4000000000 -s 4096 -n 255); a mounted image keeps the geometry it was formatted with
+ *      with -t <file> what stats prints is written to <file> as JSON at exit
+ *      snapshots are kept in memory until exit; taking one copies nothing, and a block is copied only when it is first
+ *      changed after a snapshot, the copy being shared by every snapshot taken since the block was copied last
+ *      with -l <socket> commands come from connections to Unix socket <socket> instead of the shell, each connection
+ *      being a session of its own in batch mode, run by -w <n> worker threads (4 by default, at most 32) until SIGINT or SIGTERM;
+ *      every line sent is a command and every reply is the length of its output in decimal and '\n' followed by
+ *      the output, in the order of the commands, so a client may send any number of commands before reading
+ *      with -c <socket> commands of <script> are sent over -k <n> connections (4 by default) at once, each of them
+ *      working in a directory c<k> of its own and keeping up to -q <n> commands (32 by default) unanswered;
+ *      commands/s and latency of each command from sending to reply are printed at the end
+ *
+ *  build: gcc -O2 -pthread filesystem_simulator_C.c -o filesystem_simulator_C
+ *      commands of different sessions run at once; a command which only reads or changes the working directory
+ *      locks that directory, and commands which reach across directories or over the whole disk run alone
  */
  
 #include<stdio.h>
 #include<stdbool.h>
 #include<stdlib.h>
 #include<string.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<time.h>
+#include<stdarg.h>
+#include<limits.h>
+#include<pthread.h>
+#include<signal.h>
+#include<errno.h>
+#include<poll.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<sys/epoll.h>
 
 #define INPUTSIZE 100
-#define PARTITION 1000000
-#define BLOCKSIZE 1000
-#define BLOCK PARTITION/BLOCKSIZE
-#define MAX_LENGTH 20
-#define MAX_DATA_BLOCK 100
-#define MAX_DIRECTORY 100
+#ifndef PARTITION
+#define PARTITION 1000000           //default size of a new disk in bytes
+#endif
+#define BLOCKSIZE 1000              //default size of a block in bytes
+#define MAX_LENGTH 20               //default size of a name in bytes including '\0'
+#define MAX_NAME 256                //limit of size of a name in bytes including '\0'
+#define DCACHE_SIZE 1024            //number of entries in path resolution cache
+#define BCACHE_SIZE 256             //number of block buffers in buffer cache
+#define READ_AHEAD 8                //blocks read ahead when a file is read sequentially
+#define MAX_SOURCE_DEPTH 16         //limit of nested source commands
+#define MAX_WORDS 3                 //words of a command line which are used; the rest are ignored
+#define MAX_PARTS 256               //limit of names in the paths of one command line
+#define JOURNAL_MAGIC 0x4a524e4c    //starts a transaction in the journal ("JRNL")
+#define COMMIT_MAGIC 0x434d4954     //ends a committed transaction ("CMIT")
+#define JOURNAL_GROUP 64            //default number of commands committed together
+#define JOURNAL_LIMIT (16<<20)      //journal is checkpointed and emptied when it grows past this many bytes
+#define JOURNAL_CHUNK 64            //blocks written to the journal at once
+#define FSCK_REPORT 32              //problems printed by fsck; the rest are only counted
+#define STATS_SUB_BITS 4            //latency histograms split each power of two into 1<<STATS_SUB_BITS buckets (error below 1/16)
+#define STATS_BUCKETS ((65-STATS_SUB_BITS)<<STATS_SUB_BITS)
+#define CMD_SLOTS 64                //slots of command dispatch table; a power of two above twice the number of commands
+#define DIR_LOCKS 256               //reader-writer locks shared by directories (directory d uses lock d%DIR_LOCKS)
+#define MAX_THREADS 32              //most sessions run at once by bench threads
+#define CMD_FREE 0                  //locking of a command: none, since it only runs other commands or ends the session
+#define CMD_SHARED 1                //disk is shared with other commands; the command locks what it looks at itself
+#define CMD_READ 2                  //disk is shared and working directory is locked for reading
+#define CMD_WRITE 3                 //disk is shared and working directory is locked for writing
+#define CMD_ALONE 4                 //no other command runs
+#define SERVE_WORKERS 4             //default threads running commands of connections
+#define SERVE_EVENTS 64             //epoll events taken at once
+#define CLIENT_CONNS 4              //default connections of load generator
+#define CLIENT_DEPTH 32             //default commands sent and not yet answered on each connection of load generator
+#define FS_MAGIC 0x53465346         //identifies a disk image ("FSFS")
+#define FS_VERSION 8                //on-disk format version
+#define BLK_FILE 0                  //kinds of allocated blocks; BLK_FILE and BLK_FOLDER match the boolean type of items
+#define BLK_FOLDER 1
+#define BLK_DATA 2
+#define BLK_ITEM 3
+#define BLK_SUPER 4
+#define BLK_EXTENT 5
+#define BLK_FRESH 6                 //data block never written since it was allocated; it reads as zeros
 
 /***************************functions to run commands***************************/
 
@@ -50,135 +144,701 @@ bool rm_file(char *,char *);
 bool rm_dir(char *,char *);
 bool make_dir(char *,char *);
 bool ch_dir(char *,char *);
+bool run_sync(char *,char *);
+bool run_bench(char *,char *);
+bool print_dcache(char *,char *);
+bool write_file(char *,char *);
+bool append_file(char *,char *);
+bool print_file(char *,char *);
+bool run_source(char *,char *);
+bool run_reclaim(char *,char *);
+bool run_group(char *,char *);
+bool run_fsck(char *,char *);
+bool run_stats(char *,char *);
+bool run_snapshot(char *,char *);
+bool run_restore(char *,char *);
 
 /******************************additional functions*****************************/
 
+struct super_block;
+struct folder;
+struct item_block;
+struct dir_entry;
+struct file;
+struct extent;
+struct extent_block;
+struct buffer;
+struct reclaim;
+struct check;
+struct bench_job;
+struct version;
+struct snapshot;
+struct conn;
+struct client;
+struct journal_head;
+struct cmd_stats;
+struct session;
+struct run_cmd;
+struct token;
+struct line;
 bool add_superblock(char *);
-int alloc_block(char *,bool);       //returns index of <arg1> which is of type <arg2>
-bool add_dir(char *,char *);        //adds new directory <arg2> with <arg1> as parent
-bool init();
-void parse(char *,int *,char **);   //parse <arg1> and save it to <arg3> and number of piece to <arg2>
-bool add_file(char *,char *,char *);//adds new file <arg2> at <arg1> with data size <arg3>
+int alloc_block(char *,int,int);    //returns index of <arg1> with parent <arg2> (-1 if not looked up by name) which is of kind <arg3>
+int add_dir(int,char *);            //adds new directory <arg2> with <arg1> as parent and returns its inode
+bool init(char *);                  //initializes disk in memory or in image file <arg> (NULL for memory)
+bool set_geometry(long long,int,int);   //sets size of disk <arg1>, of a block <arg2> and of a name <arg3> and allocates in-memory tables for them
+bool format();                      //creates empty filesystem in disk
+bool mount();                       //loads filesystem already present in disk
+bool tokenize(char *,int,struct line *,char *);  //splits line <arg1> of length <arg2> into <arg3> keeping the text in arena <arg4> of at least 2*(<arg2>+1) bytes
+int path_of(char *,struct token **);//points <arg2> to names in path <arg1> and returns their number
+int add_file(int,char *,char *);    //adds new file <arg2> at <arg1> with data size <arg3> and returns its inode
 void print_path();
 bool edit_file(char *, char *);     //edits file <arg1> with data size <arg2>
-int find_block(char *,char *,bool); //returns index of block named <arg1> of type <arg3> with parent <arg2>
-void r_name(char *,char *,bool);    //renames <arg1> to <arg2> of type <arg3>
-bool ch_exist(char *,char *,char *,bool);   //checks existance of <arg3> of type <arg4> in directory <arg2> whose parent is <arg1>
-void edit_dir(char *,char *,char *,bool,bool);//does <arg5> (true=>add;false=>remove) for <arg3> of type <arg4> in directory <arg2> whose parent is <arg1>
-bool del_dir(char *,char *);        //deletes directory <arg1> with <arg2> as parent
-bool del_file(char *,char *);       //deletes file <arg1> within directory <arg2>
-void parse_s(char *,int *,char **); //parse <arg1> and save it to <arg3> and number of piece to <arg2>
+int find_block(char *,int,bool);    //returns inode of block named <arg1> of type <arg3> with parent <arg2>
+int find_dir(struct token *,int);   //returns inode of directory with path <arg1> containing <arg2> names from "root"
+void r_name(int,char *);            //renames file or folder <arg1> to <arg2>
+bool ch_exist(int,char *,bool);     //checks existance of <arg2> of type <arg3> in directory <arg1>
+bool edit_dir(int,int,bool);        //does <arg3> (true=>add;false=>remove) for item <arg2> in directory <arg1>
+void drop_entry(int,int,int);       //removes item in slot <arg3> of block <arg2> from directory <arg1>
+bool relink(int,int);               //moves file or folder <arg1> into directory <arg2>
+bool del_dir(int);                  //deletes directory <arg>
+bool reclaim_add(struct reclaim *,int,int); //adds <arg3> blocks from <arg2> to blocks to be freed by <arg1>
+bool reclaim_push(struct reclaim *,int);    //adds directory <arg2> to directories to be visited by <arg1>
+bool reclaim_file(struct reclaim *,int);    //adds all blocks of file <arg2> to blocks to be freed by <arg1>
+void release_blocks(struct extent *,int);   //frees <arg2> runs of blocks <arg1> in order of address
+int cmp_extent(const void *,const void *);  //orders extents by start
+int reclaim_orphans();              //deletes directories removed with defer and returns their number
+bool fsck(bool);                    //checks the filesystem, repairing it if <arg> is true; returns true if no problem is left
+void check_dir(struct check *,int); //checks items of folder <arg2> and the item blocks holding them
+void check_file(struct check *,int);//checks extents of file <arg2> and the blocks they cover
+bool check_run(struct check *,int,int,int); //checks that <arg3> blocks from <arg2> are of kind <arg4> and not yet reached
+bool check_node(struct check *,int,int);    //same as check_run for one allocated block <arg2> of kind <arg3>
+void check_claim(struct check *,int,int);   //marks <arg3> blocks from <arg2> as reached, allocating any marked free
+void check_report(struct check *,bool,char *,...);  //counts a problem, repaired if <arg2> is true, and prints it
+void touch(void *,size_t);          //records that <arg2> bytes of disk from <arg1> are about to change
+void snap_save(int);                //copies block <arg> for the snapshots taken since it was copied last
+struct version *snap_find(int,int); //returns copy of block <arg1> as it was when snapshot <arg2> was taken, NULL if it has not changed since
+bool snap_take(char *);             //takes snapshot <arg>
+void snap_drop(struct snapshot *);  //drops snapshot <arg> and copies which no other snapshot shares
+int snap_restore(struct snapshot *);//brings disk back to snapshot <arg> and returns number of blocks copied back
+bool dir_valid(int);                //checks that <arg> is a folder reached from root by parent links
+void journal_end();                 //ends the transaction of a command; commits when the group is full
+bool journal_flush();               //commits all changed blocks to the journal and writes them to the image
+bool journal_replay(int,int);       //applies committed transactions of journal <arg2> to image <arg1> and empties the journal
+unsigned journal_sum(int,char *,int);   //returns checksum of block number <arg1> with <arg3> bytes of contents <arg2>
+void bench_journal(int);            //benchmarks <arg> mkfil/rmfil pairs with and without group commit
+void stats_record(int,long long);   //adds a run of <arg2> nanoseconds to latency histogram of run_tbl entry <arg1>
+int stats_bucket(long long);        //returns histogram bucket of latency <arg>
+long long stats_value(int);         //returns highest latency counted in histogram bucket <arg>
+long long stats_percentile(struct cmd_stats *,double);  //returns latency below which fraction <arg2> of runs counted in <arg1> fall
+void stats_dump(FILE *);            //writes counters and latencies to <arg> as JSON
+void count(long long *,long long);  //adds <arg2> to counter <arg1> which commands running at once may update
+bool session_open(struct session *,FILE *,bool);    //starts session <arg1> in root with output to <arg2>, in batch mode if <arg3> is true
+void session_close(struct session *);   //ends session <arg>
+bool dir_in_use(int);               //checks whether directory <arg> is working directory of a session or above one
+bool disk_lock(int,int *);          //takes locks of a command of locking kind <arg1> in the working directory, which is saved to <arg2> unless NULL; false if the session already runs alone
+void disk_unlock(int,int);          //releases what disk_lock took for the same arguments
+void fmap_forget();                 //drops position of last block lookup after extents of a file change
+void fmap_seek(struct file *,int);  //moves position of block lookup in file <arg1> to the extent block holding block <arg2> or before it
+bool fmap_chain(struct file *);     //lists extent blocks of file <arg> with first block of the file in each
+void dc_drop(int);                  //unlinks path cache entry <arg> and makes it the first to be reused
+void bench_threads(int);            //benchmarks <arg> commands per session with 1 to MAX_THREADS sessions at once
+void *bench_worker(void *);         //runs commands of benchmark session <arg>
+bool serve(char *,int);             //runs sessions of connections to Unix socket <arg1> with <arg2> worker threads until stopped
+void serve_accept(int);             //opens a session for each connection waiting on listening socket <arg>
+void *serve_worker(void *);         //runs commands of connections which have input
+bool serve_conn(struct conn *);     //runs commands which arrived on connection <arg>; false once it has ended
+void serve_close(struct conn *);    //ends connection <arg> and its session
+void serve_stop(int);               //signal handler ending serve
+bool buf_put(char **,size_t *,size_t *,char *,size_t);  //appends <arg5> bytes of <arg4> to buffer <arg1> of <arg2> bytes with room for <arg3>
+bool send_all(int,char *,size_t);   //writes <arg3> bytes of <arg2> to non-blocking socket <arg1>
+int sock_open(char *,bool);         //returns socket connected to (<arg2>=false) or listening on <arg1>, -1 on failure
+bool run_client(char *,int,int);    //sends script on stdin to server at <arg1> over <arg2> connections with <arg3> commands in flight
+bool client_read(struct client *,int *,int);    //takes replies arrived on <arg1> to commands of run_tbl entries <arg2> with <arg3> in flight; false once it ends
+void stats_table(FILE *);           //prints latency percentiles of each command to <arg>
+bool del_file(int);                 //deletes file <arg>
 bool dealloc_block(int);            //deallocate block with index <arg>
-char *get_parent();                 //returns name of parent directory
-void edit_path(char **,int);        //edit current path as <arg1> containing <arg2> many nodes
+bool alloc_blocks(struct file *,int);//allocates <arg2> data blocks for file <arg1> as few contiguous runs as possible
+void free_blocks(struct file *,int);//deallocates last <arg2> data blocks of file <arg1>
+bool resize_file(int,int);          //changes size of file <arg1> to <arg2> allocating or deallocating only the difference
+int next_free(int);                 //returns index of first free block at or after <arg> (wrapping around)
+int next_used(int);                 //returns index of first allocated block at or after <arg> (block_count if none before the end)
+int find_run(int,int);              //returns start of first run of <arg2> free blocks at or after <arg1> (wrapping around), -1 if none
+void mark_blocks(int,int,bool);     //marks <arg2> blocks from <arg1> as free (<arg3>=true) or allocated data blocks
+bool add_extent(struct file *,int,int);     //appends <arg3> data blocks starting at <arg2> to file <arg1>
+struct extent *tail_extent(struct file *);  //returns last extent of file <arg>
+struct extent *walk_extent(struct file *,int,int *);    //returns extent <arg2> of file <arg1>; extents are visited in order with extent block kept in <arg3> (initially -1)
+struct extent_block *get_extent_block(int); //returns extent block stored in block <arg> in place in disk
+bool path_push(int);                //makes subdirectory <arg> of working directory the working directory
+void path_pop();                    //makes parent of working directory the working directory
+bool path_set(int);                 //makes directory <arg> the working directory, rebuilding path from its ancestors
+bool path_reserve(int);             //makes room for a path of <arg> directories
+bool valid_name(char *);            //checks that <arg> is not empty, "." or "..", has no '\\' and fits in a name of a file or folder
+struct super_block *get_sblock();   //returns superblock in place in disk
+char *get_name(int);                //returns name of block <arg> in superblock
+struct folder *get_folder(int);     //returns folder stored in block <arg> in place in disk
+struct file *get_file(int);         //returns file stored in block <arg> in place in disk
+struct item_block *get_item_block(int);     //returns item block stored in block <arg> in place in disk
+struct dir_entry *walk_item(struct folder *,int,int *);     //returns item <arg2> of folder <arg1>; items are visited in order with item block kept in <arg3> (initially -1)
+struct dir_entry *entry_at(int,int);//returns item in slot <arg2> of folder or item block <arg1>
+void set_entry(int,int,int);        //records that item of block <arg1> is in slot <arg3> of block <arg2>
+void bench_dir(int);                //benchmarks a directory growing to <arg> items
+long long now_ns();                 //returns monotonic time in nanoseconds
+unsigned hash_key(char *,int,bool,int *);   //returns hash of block named <arg1> with parent <arg2> of type <arg3> and saves length of name to <arg4>
+void index_add(int,char *,int,bool);//adds block <arg1> named <arg2> with parent <arg3> of type <arg4> to block index
+void index_del(int);                //removes block <arg> from block index
+bool build_index();                 //rebuilds block index from superblock and blocks in disk
+int lookup(int,char *,bool);        //returns inode of <arg2> of type <arg3> in directory <arg1> through path resolution cache
+int lookup_locked(int,char *,bool); //same as lookup, locking directory <arg1> for reading meanwhile
+void dc_init();                     //empties path resolution cache
+int dc_find(int,char *,bool);       //returns cache entry for <arg2> of type <arg3> in directory <arg1>, -1 if not cached
+void dc_forget(int,char *,bool);    //drops cache entry for <arg2> of type <arg3> in directory <arg1>
+void dc_touch(int);                 //makes cache entry <arg> most recently used
+int file_block(int,int);            //returns disk block holding block <arg2> of file <arg1>, -1 if the file is shorter
+int read_data(int,int,char *,int);  //reads up to <arg4> bytes of file <arg1> from offset <arg2> into <arg3> and returns number of bytes read
+bool write_data(int,int,char *,int);//writes <arg4> bytes from <arg3> to file <arg1> at offset <arg2>, growing the file if needed
+void bench_io(int);                 //benchmarks reads and writes of a file of <arg> KB
+void bench_ops(int);                //benchmarks each command function on <arg> names
+void bench_scale(int);              //benchmarks operations against allocated blocks, items in a directory up to <arg> and path depth up to <arg>
+void bench_trace(char *);           //replays commands of file <arg> and reports cost per command
+void bench_row(char *,long long,long long,long long,long long); //prints time, blocks and bytes per operation for <arg2> operations named <arg1> since <arg3>, <arg4> and <arg5>
+bool bench_path(char *,struct line *,char **);  //tokenizes path of working directory followed by <arg1> as second word of <arg2> in buffer <arg3> to be freed
+void run_script(FILE *);            //runs commands read from <arg> until end of input or exit
+void run_line(char *,int,char *);   //parses and runs command line <arg1> of length <arg2> using arena <arg3>
+void unmount();                     //writes back and releases the disk
+void build_dispatch();              //fills command dispatch table from run_tbl
+struct run_cmd *find_cmd(char *);   //returns entry of run_tbl for command <arg>, NULL if there is none
+void bc_init();                     //empties buffer cache without writing anything back
+struct buffer *bc_get(int,bool);    //returns buffer holding disk block <arg1>; its data is read from disk only if <arg2> is true
+int bc_find(int);                   //returns buffer holding disk block <arg>, -1 if not cached
+void bc_forget(int,int);            //drops buffers of <arg2> blocks from <arg1> without writing them back
+void bc_drop(int);                  //drops buffer <arg> without writing it back
+void bc_flush();                    //writes every dirty buffer back to disk
+void bc_write(int);                 //writes buffer <arg> back to its disk block
+void bc_touch(int);                 //makes buffer <arg> most recently used
 //all boolean functions return true on success and false on failure
 
 struct super_block
 {
-    bool Free[BLOCK];               //true denotes free and false denotes allocated
-    bool type[BLOCK];               //true denotes folder and false denotes file
-    char (*name)[MAX_LENGTH];
-};  //keeps track of all free blocks as well as blocks allocated to files or folders along with its name
+    unsigned magic;                 //FS_MAGIC for a formatted disk
+    int version;                    //FS_VERSION of the layout
+    int block_size;                 //geometry chosen when the disk was formatted
+    int block_count;
+    int name_length;
+    int free_count;                 //number of free blocks
+    int next_fit;                   //block from where next allocation starts searching
+    int root;                       //inode of root directory
+    int orphan;                     //first directory removed but not yet freed, chained through entry_block; -1 if none
+};  //keeps track of all free blocks as well as blocks allocated to files or folders along with its name; this header is
+    //followed by the bitmap of free blocks (set bit denotes free), the kind of each block (BLK_*) and the name of each block
+
+struct dir_entry
+{
+    int inode;
+    bool type;                      //true denotes folder and false denotes file
+    char name[];                    //name_length bytes
+};  //an item of a folder; items are entry_size bytes apart
 
 struct folder
 {
-    char name[MAX_LENGTH];
-    char parent[MAX_LENGTH];
-    char (*item)[MAX_LENGTH];
-    bool item_type[MAX_LENGTH];
+    int parent;                     //inode of parent folder, -1 for root
+    int entry_block;                //block and slot holding item of this folder in its parent (-1 for root)
+    int entry_slot;
     int item_count;
-};  //structure of a folder
+    int first_block;                //chain of item blocks holding items which do not fit in the folder block, -1 if none
+    int last_block;
+    char item[];                    //first items are kept in the rest of the folder block
+};  //structure of a folder; its name is kept in the superblock
+
+struct item_block
+{
+    int prev;                       //neighbouring item blocks of same folder, -1 at the ends
+    int next;
+    char item[];
+};  //further items of a folder
+
+struct extent
+{
+    int start;                      //first data block
+    int length;                     //number of consecutive data blocks
+};  //a run of data blocks of a file
 
 struct file
 {
-    char name[MAX_LENGTH];
-    char dir_name[MAX_LENGTH];
-    int data_block[MAX_DATA_BLOCK];
-    int data_block_count;
+    int dir;                        //inode of folder holding the file
+    int entry_block;                //block and slot holding item of this file in its directory
+    int entry_slot;
     int size;
-};  //structure of a file
+    int block_count;                //number of data blocks
+    int extent_count;
+    int first_block;                //chain of extent blocks holding extents which do not fit in the file block, -1 if none
+    int last_block;
+    struct extent extent[];         //first extents are kept in the rest of the file block
+};  //structure of a file; its name is kept in the superblock
+
+struct extent_block
+{
+    int prev;                       //neighbouring extent blocks of same file, -1 at the ends
+    int next;
+    struct extent extent[];
+};  //further extents of a file
+
+struct reclaim
+{
+    struct extent *run;             //blocks to be freed; a block next to the last run extends it
+    int n;
+    int cap;
+    int *dir;                       //stack of directories still to be visited
+    int top;
+    int dir_cap;
+};  //blocks of a subtree collected for freeing at once
+
+struct check
+{
+    unsigned long long *seen;       //bitmap of blocks reached from root or from the orphan list
+    int *queue;                     //folders reached but not yet visited
+    int head;
+    int tail;
+    int *bad;                       //block and slot of each bad item of the folder being visited
+    int bad_n;
+    int bad_cap;
+    bool repair;
+    int problems;
+    int fixed;
+    int folders;
+    int files;
+};  //state of a consistency check
+
+struct bench_job
+{
+    char name[8];                   //directory of the session in _bench
+    int dir;
+    int n;                          //commands to run
+};  //work of one session of bench threads
+
+struct version
+{
+    int epoch;                      //snap_epoch when the block was copied; the copy serves the snapshots taken after the
+                                    //previous copy of the block up to this epoch
+    int refs;                       //snapshots among those which have not been dropped
+    struct version *next;           //previous copy of the same block
+    char data[];                    //block_size bytes
+};  //a block as it was before its first change after a snapshot
+
+struct snapshot
+{
+    char *name;
+    int epoch;                      //snap_epoch when taken
+    struct snapshot *next;          //snapshot taken before
+};  //a state of the disk which can be restored
+
+struct journal_head
+{
+    unsigned magic;                 //JOURNAL_MAGIC at the start and COMMIT_MAGIC at the end of a transaction
+    unsigned seq;                   //transaction number
+    int count;                      //number of blocks logged
+    int block_size;                 //bytes of each block logged
+    unsigned sum;                   //checksum of logged blocks
+};  //header and commit record of a transaction in the journal; count pairs of block number and contents lie between them
+
+struct cmd_stats
+{
+    long long count;                //runs of the command
+    long long total;                //nanoseconds spent in them
+    long long max;
+    long long hist[STATS_BUCKETS];  //runs by latency bucket (see stats_bucket)
+};  //latency of one command
+
+struct index_node
+{
+    int len;                        //length of name; the name itself is read from the superblock
+    int parent;
+    bool type;
+    bool used;                      //true denotes block is present in index
+    unsigned hash;
+    int next;                       //next block in same bucket, -1 at the end
+};  //node of in-memory block index; node i describes block i
+
+struct dentry
+{
+    char *name;                     //name_length bytes
+    int len;                        //length of name
+    int parent;
+    bool type;
+    bool used;
+    int inode;                      //-1 for negative entry (name known to be absent)
+    unsigned hash;
+    int next;                       //next entry in same bucket, -1 at the end
+    int lru_prev;                   //neighbours in circular LRU list
+    int lru_next;
+};  //entry of path resolution cache
+
+struct buffer
+{
+    int block;                      //disk block held, -1 if unused
+    bool dirty;                     //true if data is newer than disk
+    int next;                       //next buffer in same bucket, -1 at the end
+    int lru_prev;                   //neighbours in circular LRU list
+    int lru_next;
+    char *data;                     //block_size bytes
+};  //buffer of write-back block cache; only data blocks are cached
+
+struct file_map
+{
+    int file;                       //inode of mapped file, -1 if none
+    int i;                          //current extent, its extent block and first block of the file in it
+    int b;
+    int base;
+    struct extent *ext;
+    int chain_count;                //extent blocks of the file and first block of the file in each, -1 if not listed yet
+    int chain_cap;
+    int *chain;
+    int *chain_base;
+};  //position of last block lookup, so that sequential access does not walk the extents again
+
+struct token
+{
+    char *s;                        //text in the arena, '\0' terminated
+    int len;
+};  //a word of a command line or a name in a path
 
-struct working_dir
+struct line
 {
-    char name[MAX_LENGTH];
-    char parent[MAX_LENGTH];
-};  //denotes working directory
+    int n;                          //number of words
+    struct token word[MAX_WORDS];
+    int first[MAX_WORDS];           //first name of each word in part
+    int count[MAX_WORDS];           //number of names of each word
+    int parts;
+    struct token part[MAX_PARTS];   //words split at '\'
+};  //a tokenized command line
 
 struct working_path
 {
-    char name[MAX_LENGTH];
-    struct working_path *next;
+    int *inode;                     //directories from root to working directory
+    int *end;                       //length of prompt up to and including each of them
+    int depth;                      //number of directories in path
+    int cap;                        //room in inode and end
+    char *prompt;                   //"\\root\\...> " kept rendered
 };  //keeps track of current path
 
+struct session
+{
+    int working;                    //inode of working directory
+    struct working_path path;
+    struct line *cur_line;          //command line being run
+    FILE *out;                      //output of commands
+    bool batch;                     //true in batch mode: no prompts and no questions
+    bool quit;                      //set by exit command
+    bool alone;                     //true while a command of the session runs alone
+    int source_depth;               //number of source commands being run
+    unsigned gen;                   //tree_gen when path was rendered
+    long long cmd_count,err_count;  //commands run and commands failed or not found
+    struct session *next;           //next open session
+};  //state of one user of the filesystem; every thread serves one session at a time
+
+struct conn
+{
+    int fd;
+    struct session s;
+    FILE *out;                      //output of commands run so far, kept in out_buf
+    char *out_buf;
+    size_t out_size;
+    char *in;                       //bytes received and not run yet; a line is run once its '\n' has arrived
+    size_t in_len,in_cap;
+    char *arena;                    //2*(in_cap+1) bytes for tokenize
+    char *reply;                    //replies not sent yet
+    size_t reply_len,reply_cap;
+    bool eof;                       //peer has closed its side
+    struct conn *next;              //next connection waiting for a worker
+};  //connection to the server; only one worker at a time holds it, between two epoll events
+
+struct client
+{
+    int fd;                         //-1 once every reply has arrived
+    long long *sent;                //time of sending of commands in flight, by command number modulo depth
+    int next;                       //commands sent and replies taken
+    int done;
+    char *out;                      //commands not written to the socket yet
+    size_t out_len,out_cap;
+    long long len;                  //length of output of the reply being read, as far as its digits have arrived
+    long long need;                 //bytes of that output still to skip, -1 while reading its length
+};  //connection of load generator
+
 char *disk;
-struct working_dir working;
-struct working_path path;
+int disk_fd=-1;                     //image file backing the disk, -1 if disk is only in memory
+long long partition=PARTITION;      //geometry of the disk: bytes in disk, in a block and in a name including '\0'
+int block_size=BLOCKSIZE;
+int name_length=MAX_LENGTH;
+int block_count;                    //values derived from the geometry
+int map_words;                      //number of 64-bit words in free block bitmap
+int sblock_size;                    //number of blocks taken by superblock
+int entry_size;                     //bytes of an item of a folder
+int head_items,block_items;         //items in the folder block and in one item block
+int head_extents,block_extents;     //extents in the file block and in one extent block
+unsigned long long *free_map;       //parts of superblock which follow its header
+char *block_type;
+char *block_name;
+struct index_node *idx_node;        //hash index over (parent inode,name,type) of every file and folder
+int *idx_head;                      //first block in each bucket (one per block keeps chains short), -1 if bucket is empty
+struct dentry dcache[DCACHE_SIZE];  //LRU cache of (parent inode,name,type) to inode including negative entries
+int dc_head[DCACHE_SIZE];           //first entry in each bucket, -1 if bucket is empty
+int dc_mru;                         //most recently used entry; least recently used one precedes it
+long long dc_hits,dc_misses;
+struct buffer bcache[BCACHE_SIZE];
+int bc_head[BCACHE_SIZE];           //first buffer in each bucket, -1 if bucket is empty
+int bc_mru;                         //most recently used buffer; least recently used one precedes it
+long long bc_hits,bc_misses;
+struct file_map fmap;
+int ra_file,ra_block;               //file and block which a sequential read continues with
+int journal_fd=-1;                  //journal of the image, -1 if disk is only in memory
+off_t journal_size;                 //bytes in journal since last checkpoint
+unsigned journal_seq;               //number of next transaction
+int group_size=JOURNAL_GROUP;       //commands per commit
+int group_pending;                  //commands since last commit
+unsigned long long *dirty_map;      //blocks changed since last commit
+int *dirty_list;                    //the same blocks in order of first change
+char *journal_buf;                  //JOURNAL_CHUNK pairs of block number and contents
+int dirty_count;
+long long journal_commits,journal_blocks;
+long long alloc_count;              //blocks allocated since start
+long long touch_bytes;              //bytes of disk changed since start
+long long find_calls,find_scanned;  //block index lookups and index nodes compared by them
+long long alloc_calls,dealloc_calls;
+long long copy_bytes;               //bytes of block contents copied between disk, buffer cache, journal and callers
+char *stats_file;                   //file written by stats_dump at exit, NULL if none
+_Thread_local struct session *sess; //session served by this thread
+struct session *sessions;           //open sessions
+unsigned tree_gen;                  //changed by every command run alone, after which paths of sessions are rendered again
+pthread_rwlock_t disk_rw=PTHREAD_RWLOCK_INITIALIZER;    //held for writing by commands run alone and for reading by the rest
+pthread_rwlock_t dir_rw[DIR_LOCKS]; //locks of directories
+pthread_rwlock_t index_rw=PTHREAD_RWLOCK_INITIALIZER;   //block index
+pthread_mutex_t alloc_mx;           //free block bitmap and its counters, taken again by the allocator for reclaimed blocks
+pthread_mutex_t dc_mx=PTHREAD_MUTEX_INITIALIZER;        //path resolution cache
+pthread_mutex_t bc_mx=PTHREAD_MUTEX_INITIALIZER;        //buffer cache, fmap and read-ahead position
+pthread_mutex_t journal_mx=PTHREAD_MUTEX_INITIALIZER;   //blocks changed since last commit
+pthread_mutex_t session_mx=PTHREAD_MUTEX_INITIALIZER;   //list of sessions
+int serve_epoll=-1;                 //epoll of listening socket and connections of server
+struct conn *ready_head,*ready_tail;    //connections with events waiting for a worker
+pthread_mutex_t ready_mx=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ready_cv=PTHREAD_COND_INITIALIZER;
+volatile sig_atomic_t serve_done;   //set by SIGINT and SIGTERM
+bool serve_end;                     //tells workers to return once no connection is waiting
+struct snapshot *snapshots;         //newest first
+int snap_epoch;                     //number of snapshots taken
+int *snap_mod;                      //snap_epoch when each block was copied last, NULL while there is no snapshot
+struct version **snap_ver;          //copies of each block, newest first
+int *snap_list,snap_count;          //blocks which have copies
+long long snap_blocks;              //copies kept
+bool snap_lost;                     //a copy could not be made, so that older snapshots cannot be restored
 
 struct run_cmd
 {
     char *cmd;
     bool (*run)(char *name,char *data);
+    int lock;                       //CMD_* locking done around the command
 }run_tbl[]={
-    {"ls",  print_item},
-    {"mkdir",make_dir},
-    {"rndir",move_dir},
-    {"cd",  ch_dir},
-    {"rmdir",rm_dir},
-    {"mvdir",move_dir},
-    {"mkfil",make_file},
-    {"rnfil",move_file},
-    {"rmfil",rm_file},
-    {"mvfil",move_file},
-    {"exit",run_exit},
-    {"NONE",NULL}
+    {"ls",  print_item,CMD_READ},
+    {"mkdir",make_dir,CMD_WRITE},
+    {"rndir",move_dir,CMD_ALONE},
+    {"cd",  ch_dir,CMD_SHARED},
+    {"rmdir",rm_dir,CMD_ALONE},
+    {"mvdir",move_dir,CMD_ALONE},
+    {"mkfil",make_file,CMD_WRITE},
+    {"rnfil",move_file,CMD_ALONE},
+    {"rmfil",rm_file,CMD_WRITE},
+    {"mvfil",move_file,CMD_ALONE},
+    {"write",write_file,CMD_WRITE},
+    {"append",append_file,CMD_WRITE},
+    {"cat", print_file,CMD_READ},
+    {"sync",run_sync,CMD_ALONE},
+    {"bench",run_bench,CMD_FREE},
+    {"dcache",print_dcache,CMD_ALONE},
+    {"source",run_source,CMD_FREE},
+    {"reclaim",run_reclaim,CMD_ALONE},
+    {"group",run_group,CMD_ALONE},
+    {"fsck",run_fsck,CMD_ALONE},
+    {"stats",run_stats,CMD_ALONE},
+    {"snapshot",run_snapshot,CMD_ALONE},
+    {"restore",run_restore,CMD_ALONE},
+    {"exit",run_exit,CMD_FREE},
+    {NULL,NULL,CMD_FREE}
 };  //structure to connect commands to respective functions
+int cmd_slot[CMD_SLOTS];            //open addressing table of run_tbl entries by command name, -1 if slot is empty
+struct cmd_stats cmd_time[sizeof(run_tbl)/sizeof(*run_tbl)];    //latency of each command of run_tbl
+_Static_assert(2*sizeof(run_tbl)/sizeof(*run_tbl)<=CMD_SLOTS,"CMD_SLOTS too small for run_tbl");
 
 /*-----------------------------------------------------------------------------*/
 /**********************************Driver code**********************************/
 
-int main()
+int main(int argc,char *argv[])
 {
-    char input[INPUTSIZE];
-    printf("\t\t\t\t**Welcome in the filesystem**\n\t\t\t\t=============================\n");
-//initialize disk
-    if(!init())
+    char *image=NULL,*listen_on=NULL,*client=NULL;
+    int workers=SERVE_WORKERS,conns=CLIENT_CONNS,depth=CLIENT_DEPTH;
+    struct session console={0};
+    console.out=stdout;
+    sess=&console;
+    for(int i=1;i<argc;i++)
+        if(!strcmp(argv[i],"-b"))
+            sess->batch=true;
+        else if(!strcmp(argv[i],"-l")&&-~i<argc)
+            listen_on=argv[++i];
+        else if(!strcmp(argv[i],"-w")&&-~i<argc)
+            workers=atoi(argv[++i]);
+        else if(!strcmp(argv[i],"-c")&&-~i<argc)
+            client=argv[++i];
+        else if(!strcmp(argv[i],"-k")&&-~i<argc)
+            conns=atoi(argv[++i]);
+        else if(!strcmp(argv[i],"-q")&&-~i<argc)
+            depth=atoi(argv[++i]);
+        else if(!strcmp(argv[i],"-p")&&-~i<argc)
+            partition=atoll(argv[++i]);
+        else if(!strcmp(argv[i],"-s")&&-~i<argc)
+            block_size=atoi(argv[++i]);
+        else if(!strcmp(argv[i],"-n")&&-~i<argc)
+            name_length=-~atoi(argv[++i]);
+        else if(!strcmp(argv[i],"-t")&&-~i<argc)
+            stats_file=argv[++i];
+        else
+            image=argv[i];
+//the server and the load generator have no shell
+    if(NULL!=listen_on||NULL!=client)
+        sess->batch=true;
+//output is flushed only when the buffer fills up in batch mode
+    if(sess->batch)
+        setvbuf(stdout,NULL,_IOFBF,1<<16);
+    else
+        fprintf(sess->out,"\t\t\t\t**Welcome in the filesystem**\n\t\t\t\t=============================\n");
+    build_dispatch();
+//the load generator needs no disk; replies are timed by the command they answer
+    if(NULL!=client)
+        run_client(client,0<conns?conns:1,0<depth?depth:1);
+//initialize disk; the shell is the first session
+    else if(!init(image)||!session_open(&console,stdout,console.batch))
     {
-        printf("\tERROR: Disk initialization failed!");
+        fprintf(sess->out,"\tERROR: Disk initialization failed!");
         return 0;
     }
+    else if(NULL!=listen_on)
+        serve(listen_on,0<workers?workers:1);
+    else
+    {
+        long long t=now_ns();
 //print current path in shell
-    print_path();
-    char *cmd,*name,*data;
-//get input and run respective command
-    while(fgets(input, INPUTSIZE, stdin)!=NULL)
+        if(!sess->batch)
+            print_path();
+        run_script(stdin);
+        if(sess->batch)
+            fprintf(sess->out,"\t%lld commands, %lld errors, %.3f s\n",sess->cmd_count,sess->err_count,(now_ns()-t)/1e9);
+    }
+    FILE *out;
+    if(NULL!=stats_file)
     {
-        char *arr[INPUTSIZE];
-        int n=0;
-//parse the input
-        parse(input,&n,arr);
-        if(!n)
-            continue;               //nothing to run take next command from I/O
-        cmd=arr[0];
-        name=arr[1];
-        data=arr[2];
-        bool valid=false;           //true if inserted command is valid
-//go through the command list to find appropriate function to run
-        for(struct run_cmd *action=run_tbl;action->cmd!="NONE";action++)
-//if matched then run corresponding function
-            if(!strcmp(cmd,action->cmd))
-            {
-                valid=true;
-//if failed to run then print error message
-                if(!((action->run)(name,data)))
-                    printf("\tERROR: %s %s: failed\n",cmd,name);
+        if(NULL==(out=fopen(stats_file,"w")))
+            fprintf(sess->out,"\t%s: cannot open\n",stats_file);
+        else
+        {
+            stats_dump(out);
+            fclose(out);
+        }
+    }
+    if(NULL!=client)
+        return 0;
+    session_close(&console);
+    unmount();
+    return 0;
+}
+
+//get input and run respective command; lines of any length are read and the arena grows with the line buffer
+void run_script(FILE *in)
+{
+    char *input=NULL,*arena=NULL;
+    size_t cap=0,size=0;
+    for(ssize_t len;!sess->quit&&-1!=(len=getline(&input,&cap,in));)
+    {
+        if(size<2*(cap+1))
+        {
+            free(arena);
+            if(NULL==(arena=malloc(size=2*(cap+1))))
                 break;
-            }
+        }
+        run_line(input,len,arena);
+        if(!sess->batch&&!sess->quit)
+            print_path();
+    }
+    free(input);
+    free(arena);
+}
+
+void run_line(char *input,int len,char *arena)
+{
+    struct line line,*was=sess->cur_line;
+//parse the input
+    bool ok=tokenize(input,len,&line,arena);
+    if(!line.n)
+        return;                     //nothing to run take next command from I/O
+    char *cmd=line.word[0].s,*name=1<line.n?line.word[1].s:"",*data=2<line.n?line.word[2].s:"";
+    sess->cmd_count++;
+    if(!ok)
+    {
+        fprintf(sess->out,"\t%s: too many names in paths\n",cmd);
+        sess->err_count++;
+        return;
+    }
+//find appropriate function to run
+    struct run_cmd *action=find_cmd(cmd);
+    sess->cur_line=&line;
 //if invalid print appropriate message
-        if(!valid)
-            printf("\t%s: command not found\n",cmd);
-        print_path();
+    if(NULL==action)
+    {
+        fprintf(sess->out,"\t%s: command not found\n",cmd);
+        sess->err_count++;
+    }
+    else
+    {
+//time the command; a failed one is counted too
+        int d;
+        bool held=disk_lock(action->lock,&d);
+        long long t=now_ns();
+        bool done=(action->run)(name,data);
+        stats_record(action-run_tbl,now_ns()-t);
+//a command run alone may have renamed or moved directories in the paths of other sessions
+        if(CMD_ALONE==action->lock)
+            sess->gen=++tree_gen;
+        if(held)
+            disk_unlock(action->lock,d);
+//if failed to run then print error message
+        if(!done)
+        {
+            fprintf(sess->out,"\tERROR: %s %s: failed\n",cmd,name);
+            sess->err_count++;
+        }
+    }
+    sess->cur_line=was;
+    journal_end();
+}
+
+//hashes every command name once; a command is added by its run_tbl entry alone
+void build_dispatch()
+{
+    for(int i=0;i<CMD_SLOTS;i++)
+        cmd_slot[i]=-1;
+    for(int i=0;NULL!=run_tbl[i].cmd;i++)
+    {
+        int len;
+        unsigned h=hash_key(run_tbl[i].cmd,-1,false,&len);
+        while(-1!=cmd_slot[h&~-CMD_SLOTS])
+            h++;
+        cmd_slot[h&~-CMD_SLOTS]=i;
     }
-    return 0;
+}
+
+//probes from the slot of the name's hash up to the first empty slot
+struct run_cmd *find_cmd(char *cmd)
+{
+    int len;
+    for(unsigned h=hash_key(cmd,-1,false,&len);-1!=cmd_slot[h&~-CMD_SLOTS];h++)
+        if(!strcmp(cmd,run_tbl[cmd_slot[h&~-CMD_SLOTS]].cmd))
+            return &run_tbl[cmd_slot[h&~-CMD_SLOTS]];
+    return NULL;
 }
 
 /*-----------------------------------------------------------------------------*/
@@ -187,16 +847,14 @@ int main()
 //prints list of items in current directory ("ls" command)
 bool print_item(char *name,char *empty)
 {
-    struct folder *dir=malloc(BLOCKSIZE);
-//find location of current directory in disk
-    int block_index=find_block(working.name,working.parent,true);
-//copy current directory block from disk to memory
-    memcpy(dir,disk+block_index*BLOCKSIZE,BLOCKSIZE);
+    struct folder *dir=get_folder(sess->working);
 //go through the item list and print their name(type)
-    for(int i=~-(dir->item_count);~i;i--)
-        printf("%s(%s)\t\t",dir->item[i],dir->item_type[i]?"dir":"file");
-    printf("\n");
-    free(dir);
+    for(int i=0,b=-1;i<dir->item_count;i++)
+    {
+        struct dir_entry *item=walk_item(dir,i,&b);
+        fprintf(sess->out,"%s(%s)\t\t",item->name,item->type?"dir":"file");
+    }
+    fprintf(sess->out,"\n");
     return true;
 }
 
@@ -204,118 +862,113 @@ bool print_item(char *name,char *empty)
 bool make_dir(char *name,char *empty)
 {
 //null directory or directory name "root" is not allowed
-    if(NULL==name||!strcmp(name,"root"))
+    if(NULL==name||!strcmp(name,"root")||!valid_name(name))
         return false;
 //check wheather there already exists a directory with same name
-    if(ch_exist(working.parent,working.name,name,true))
+    if(ch_exist(sess->working,name,true))
     {
-        printf("Directory \"%s\" already exists\n",name);
+        fprintf(sess->out,"Directory \"%s\" already exists\n",name);
         return true;
     }
 //add the directory to the filesystem
-    if(!add_dir(working.name,name))
+    int c=add_dir(sess->working,name);
+    if(-1==c)
         return false;
 //update current directory adding new directory as an item in it
-    edit_dir(working.parent,working.name,name,true,true);
+    if(!edit_dir(sess->working,c,true))
+    {
+//if current directory cannot grow then remove the new directory
+        del_dir(c);
+        return false;
+    }
     return true;
 }
 
 //moves a directory to specified destination
 bool move_dir(char *name,char *loc)
 {
-    if(!ch_exist(working.parent,working.name,name,true))
+    int c=lookup(sess->working,name,true);
+    if(-1==c)
     {
-        printf("\tNo such directory\n");
+        fprintf(sess->out,"\tNo such directory\n");
         return true;
     }
-    char *dest[INPUTSIZE];
-    int n=0;
-    parse_s(loc,&n,dest);
+    struct token *dest;
+    int n=path_of(loc,&dest);
     if(!n)
         return false;
-//either destination is "root" or rename name to dest[0]
-    if(!~-n)
+//rename the directory if destination is a single name other than "root"
+    if(!~-n&&strcmp(dest[0].s,"root"))
     {
-//rename the directory
-        if(strcmp(dest[0],"root"))
-        {
-            if(ch_exist(working.parent,working.name,dest[0],true))
-            {
-                printf("\tdirectory \"%s\" already exists\n",dest[0]);
-                return true;
-            }
-            r_name(name,dest[0],true);
-            return true;
-        }
-        if(!strcmp(working.name,"root"))
-            return true;
-        if(ch_exist("","root",name,true))
+        if(!valid_name(dest[0].s))
+            return false;
+        if(ch_exist(sess->working,dest[0].s,true))
         {
-            printf("\tDirectory already exists.\n");
+            fprintf(sess->out,"\tdirectory \"%s\" already exists\n",dest[0].s);
             return true;
         }
-        edit_dir(working.parent,working.name,name,true,false);
-        struct folder *dir=malloc(BLOCKSIZE);
-        int block_index=find_block(name,working.name,true);
-        memcpy(dir,disk+block_index*BLOCKSIZE,BLOCKSIZE);
-        strcpy(dir->parent,"root");
-        memcpy(disk+block_index*BLOCKSIZE,dir,BLOCKSIZE);
-        free(dir);
-        edit_dir("","root",name,true,true);
+        r_name(c,dest[0].s);
         return true;
     }
-//destination is not "root"
 //check validity of the path
-    if(strcmp(dest[0],"root")||!ch_exist("",dest[0],dest[1],true))
+    int d=find_dir(dest,n);
+    if(-1==d)
     {
-        printf("\tInvalid path\n");
+        fprintf(sess->out,"\tInvalid path\n");
         return false;
     }
-    if(!(strcmp(working.name,dest[0])&&(strcmp(working.name,dest[1])||strcmp(working.parent,dest[0]))))
-    {
-        printf("\tInvalid move\n");
+    if(d==sess->working)
         return true;
-    }
-    for(int i=2;i<n;i++)
-    {
-        if(!ch_exist(dest[~-~-i],dest[~-i],dest[i],true))
-        {
-            printf("\tInvalid path\n");
-            return false;
-        }
-        if(!(strcmp(working.name,dest[i])||strcmp(working.parent,dest[~-i])))
+//a directory cannot be moved inside itself
+    for(int i=d;-1!=i;i=get_folder(i)->parent)
+        if(i==c)
         {
-            printf("\tInvalid move\n");
+            fprintf(sess->out,"\tInvalid move\n");
             return true;
         }
+    if(ch_exist(d,name,true))
+    {
+        fprintf(sess->out,"\tDirectory already exists.\n");
+        return true;
     }
-    edit_dir(working.parent,working.name,name,true,false);
-    struct folder *dir=malloc(BLOCKSIZE);
-    int block_index=find_block(name,working.name,true);
-    memcpy(dir,disk+block_index*BLOCKSIZE,BLOCKSIZE);
-    strcpy(dir->parent,dest[~-n]);
-    memcpy(disk+block_index*BLOCKSIZE,dir,BLOCKSIZE);
-    free(dir);
-    edit_dir(dest[~-~-n],dest[~-n],name,true,true);
-    return true;
+    return relink(c,d);
 }
 
 //removes a subdirectory from current directory ("rmdir" command)
-bool rm_dir(char *name,char *empty)
+bool rm_dir(char *name,char *mode)
 {
 //check validity/existance of subdirectory
-    if(!(strcmp(name,"")&&strcmp(name,".")&&strcmp(name,"..")&&ch_exist(working.parent,working.name,name,true)))
+    int c=lookup(sess->working,name,true);
+    if(!(strcmp(name,"")&&strcmp(name,".")&&strcmp(name,"..")&&-1!=c))
     {
-        printf("\tNo such directory\n");
+        fprintf(sess->out,"\tNo such directory\n");
+        return true;
+    }
+//a directory which another session is in stays
+    if(dir_in_use(c))
+    {
+        fprintf(sess->out,"\tDirectory \"%s\" is in use\n",name);
         return true;
     }
 //update current directory item list
-    edit_dir(working.parent,working.name,name,true,false);
+    edit_dir(sess->working,c,false);
+//deferred removal only detaches the directory; it is kept on disk in the orphan list until reclaimed
+    if(!strcmp(mode,"defer"))
+    {
+        struct folder *dir=get_folder(c);
+        index_del(c);
+        touch(dir,sizeof(struct folder));
+        dir->parent=-1;
+        dir->entry_block=get_sblock()->orphan;
+        touch(&get_sblock()->orphan,sizeof(int));
+        get_sblock()->orphan=c;
+        return true;
+    }
 //remove the directory from filesystem
-    if(!del_dir(name,working.name))
+    if(!del_dir(c))
     {
 //if failed the restore current directory item list
-        edit_dir(working.parent,working.name,name,true,true);
+        edit_dir(sess->working,c,true);
         return false;
     }
     return true;
@@ -324,10 +977,9 @@ bool rm_dir(char *name,char *empty)
 //change current working directory ("chdir" command)
 bool ch_dir(char *input,char *empty)
 {
-    char *name[INPUTSIZE];
-    int n=0;
-//parse the destination
-    parse_s(input,&n,name);
+    struct token *name;
+//names in the destination
+    int n=path_of(input,&name);
 //no destination specified
     if(!n)
         return false;
@@ -335,680 +987,3541 @@ bool ch_dir(char *input,char *empty)
     if(!~-n)
     {
 //destination is current directory itself
-        if(!strcmp(name[0],"."))
+        if(!strcmp(name[0].s,"."))
             return true;
 //destination is parent directory
-        if(!strcmp(name[0],".."))
+        if(!strcmp(name[0].s,".."))
         {
 //if current directory is "root" then there is no parent
-            if(!strcmp(working.name,"root"))
+            if(-1==get_folder(sess->working)->parent)
                 return true;
-            char *parent=get_parent();
-            strcpy(working.name,working.parent);
-            strcpy(working.parent,parent);
 //update current path
-            edit_path(name,n);
+            path_pop();
             return true;
         }
 //destination is "root"
-        if(!strcmp(name[0],"root"))
-        {
-            strcpy(working.parent,"");
-            strcpy(working.name,"root");
-            edit_path(name,n);
-            return true;
-        }
+        if(!strcmp(name[0].s,"root"))
+            return path_set(get_sblock()->root);
 //destination is a subdirectory; check existance of that subdirectory
-        if(!ch_exist(working.parent,working.name,name[0],true))
+        int c=lookup_locked(sess->working,name[0].s,true);
+        if(-1==c)
         {
-            printf("\tNo such directory\n");
+            fprintf(sess->out,"\tNo such directory\n");
             return true;
         }
-        strcpy(working.parent,working.name);
-        strcpy(working.name,name[0]);
-        edit_path(name,n);
-        return true;
+        return path_push(c);
     }
 //whole path of destination is specified; check validity of the path
-    if(strcmp(name[0],"root")||!ch_exist("",name[0],name[1],true))
+    int d=find_dir(name,n);
+    if(-1==d)
     {
-        printf("\tInvalid path\n");
+        fprintf(sess->out,"\tInvalid path\n");
         return true;
     }
-    for(int i=2;i<n;i++)
-        if(!ch_exist(name[~-~-i],name[~-i],name[i],true))
-        {
-            printf("\tInvalid path\n");
-            return true;
-        }
-    strcpy(working.parent,name[~-~-n]);
-    strcpy(working.name,name[~-n]);
-    edit_path(name,n);
-    return true;
+    return path_set(d);
 }
 
 //creates new file ("mkfil" command)
 bool make_file(char *name, char *data)
 {
 //no name specified or file named "root" is not allowed
-    if(NULL==name||!strcmp(name,"root"))
+    if(NULL==name||!strcmp(name,"root")||!valid_name(name))
         return false;
-//check wheather there already exists a file with same name
-    if(ch_exist(working.parent,working.name,name,false))
+//check wheather there already exists a file with same name; batch mode always edits it
+    if(ch_exist(sess->working,name,false))
     {
-        char a;
-        printf("File already exists. Do you want to EDIT it (if yes, type y/Y; otherwise type any other key)?\t");
-        scanf("%c",&a);
-        if('y'==a||'Y'==a)
+        char a[INPUTSIZE];
+        if(sess->batch)
+            return edit_file(name,data);
+        fprintf(sess->out,"File already exists. Do you want to EDIT it (if yes, type y/Y; otherwise type any other key)?\t");
+//read the whole answer line so that it is not taken as next command
+        if(NULL!=fgets(a,INPUTSIZE,stdin)&&('y'==*a||'Y'==*a))
             return edit_file(name,data);
         return true;
     }
 //add the file to the filesystem
-    if(!add_file(working.name,name,data))
+    int c=add_file(sess->working,name,data);
+    if(-1==c)
+        return false;
+    if(!edit_dir(sess->working,c,true))
+    {
+        del_file(c);
         return false;
-    edit_dir(working.parent,working.name,name,false,true);
+    }
     return true;
 }
 
 //moves a file to specified destination
 bool move_file(char *name,char *loc)
 {
-    if(!ch_exist(working.parent,working.name,name,false))
+    int c=lookup(sess->working,name,false);
+    if(-1==c)
     {
-        printf("\tNo such file\n");
+        fprintf(sess->out,"\tNo such file\n");
         return true;
     }
-    char *dest[INPUTSIZE];
-    int n=0;
-    parse_s(loc,&n,dest);
+    struct token *dest;
+    int n=path_of(loc,&dest);
     if(!n)
         return false;
-//either destination is "root" or rename name to dest[0]
-    if(!~-n)
+//rename the file if destination is a single name other than "root"
+    if(!~-n&&strcmp(dest[0].s,"root"))
     {
-//rename the file
-        if(strcmp(dest[0],"root"))
-        {
-            if(ch_exist(working.parent,working.name,dest[0],false))
-            {
-                printf("\tfile \"%s\" already exists\n",dest[0]);
-                return true;
-            }
-            r_name(name,dest[0],false);
-            return true;
-        }
-        if(!strcmp(working.name,"root"))
-            return true;
-        if(ch_exist("","root",name,false))
+        if(!valid_name(dest[0].s))
+            return false;
+        if(ch_exist(sess->working,dest[0].s,false))
         {
-            printf("\tFile already exists.\n");
+            fprintf(sess->out,"\tfile \"%s\" already exists\n",dest[0].s);
             return true;
         }
-        edit_dir(working.parent,working.name,name,false,false);
-        struct file *fp=malloc(BLOCKSIZE);
-        int block_index=find_block(name,working.name,false);
-        memcpy(fp,disk+block_index*BLOCKSIZE,BLOCKSIZE);
-        strcpy(fp->dir_name,"root");
-        memcpy(disk+block_index*BLOCKSIZE,fp,BLOCKSIZE);
-        free(fp);
-        edit_dir("","root",name,false,true);
+        r_name(c,dest[0].s);
         return true;
     }
-//destination is not "root"
-    if(strcmp(dest[0],"root")||!ch_exist("",dest[0],dest[1],true))
+//check validity of the path
+    int d=find_dir(dest,n);
+    if(-1==d)
     {
-        printf("\tInvalid path\n");
+        fprintf(sess->out,"\tInvalid path\n");
         return false;
     }
-    for(int i=2;i<n;i++)
-        if(!ch_exist(dest[~-~-i],dest[~-i],dest[i],true))
-        {
-            printf("\tInvalid path\n");
-            return false;
-        }
-    edit_dir(working.parent,working.name,name,false,false);
-    struct file *fp=malloc(BLOCKSIZE);
-    int block_index=find_block(name,working.name,false);
-    memcpy(fp,disk+block_index*BLOCKSIZE,BLOCKSIZE);
-    strcpy(fp->dir_name,dest[~-n]);
-    memcpy(disk+block_index*BLOCKSIZE,fp,BLOCKSIZE);
-    free(fp);
-    edit_dir(dest[~-~-n],dest[~-n],name,false,true);
-    return true;
+    if(d==sess->working)
+        return true;
+    if(ch_exist(d,name,false))
+    {
+        fprintf(sess->out,"\tFile already exists.\n");
+        return true;
+    }
+    return relink(c,d);
 }
 
 //removes a file from current directory ("rmfil" command)
 bool rm_file(char *name,char *empty)
 {
 //check validity/existance of the file
-    if(!(strcmp(name,"")&&ch_exist(working.parent,working.name,name,false)))
+    int c=lookup(sess->working,name,false);
+    if(!strcmp(name,"")||-1==c)
     {
-        printf("\tNo such file\n");
+        fprintf(sess->out,"\tNo such file\n");
         return true;
     }
-    edit_dir(working.parent,working.name,name,false,false);
+    edit_dir(sess->working,c,false);
 //remove the file from filesystem
-    if(!del_file(name,working.name))
+    if(!del_file(c))
     {
-        edit_dir(working.parent,working.name,name,false,true);
+        edit_dir(sess->working,c,true);
         return false;
     }
     return true;
 }
 
-//exit from the program
-bool run_exit(char *name,char *empty)
+//replaces contents of a file ("write" command)
+bool write_file(char *name,char *data)
 {
-    exit(0);
-    return true;
+    int c=lookup(sess->working,name,false);
+//create the file if it does not exist
+    if(-1==c&&(!make_file(name,"0")||-1==(c=lookup(sess->working,name,false))))
+        return false;
+    int n=strlen(data);
+    return resize_file(c,n)&&write_data(c,0,data,n);
 }
 
-/*-----------------------------------------------------------------------------*/
-/******************************additional functions*****************************/
-
-//parse the input with whitespace as delimiter
-void parse(char *input,int *num,char *parsed[])
+//adds data at the end of a file ("append" command)
+bool append_file(char *name,char *data)
 {
-    char *del;                              //address of delimeter in input
-    char sp[]=" \t\n";                      //array of delimiters
-    while(true)
-    {
-        input+=strspn(input,sp);            //skip initial whitespace
-//if there is no more whitespace then break
-        if(NULL==(del=strpbrk(input,sp)))   //get next delimiter
-            break;
-        parsed[(*num)++]=input;             //add to the parsed array
-        *del='\0';                          //specify end of string
-        input=del+1;
-    }
-//if number of pieces is less than three then add null strings
-    if(!(*num))
-        return;
-    while(3>(*num))
-        parsed[(*num)++]="";
+    int c=lookup(sess->working,name,false);
+    if(-1==c&&(!make_file(name,"0")||-1==(c=lookup(sess->working,name,false))))
+        return false;
+    return write_data(c,get_file(c)->size,data,strlen(data));
 }
 
-//parse string with '/' as delimiter
-void parse_s(char *input,int *num,char *parsed[])
+//prints contents of a file ("cat" command)
+bool print_file(char *name,char *empty)
 {
-//if input is null then nothing to parse
-    if(NULL==input)
-        return;
-    char *del;
-    char bs[]="\\";
-    while(true)
+    int c=lookup(sess->working,name,false);
+    if(-1==c)
     {
-        input+=strspn(input,bs);
-        if(NULL==(del=strpbrk(input,bs)))
-            break;
-        parsed[(*num)++]=input;
-        *del='\0';
-        input=del+1;
+        fprintf(sess->out,"\tNo such file\n");
+        return true;
     }
-//add the last substring
-    if(!strcmp(input,""))
-        return;
-    parsed[(*num)++]=input;
+    char buf[BLOCKSIZE];
+    for(int off=0,n;0<(n=read_data(c,off,buf,sizeof(buf)));off+=n)
+        fwrite(buf,1,n,sess->out);
+    fprintf(sess->out,"\n");
+    return true;
 }
 
-//goes through the linked list working_path and prints current path
-void print_path()
+//writes the disk image back to its file ("sync" command)
+bool run_sync(char *name,char *empty)
 {
-    struct working_path *p=&path;
-    while(NULL!=p)
-    {
-        printf("\\%s",p->name);
-        p=p->next;
-    }
-    printf("> ");
+    bc_flush();
+//nothing to write if disk is only in memory
+    if(-1==disk_fd)
+        return true;
+//commit, then checkpoint so that the journal can be emptied
+    if(!journal_flush()||fdatasync(disk_fd)||ftruncate(journal_fd,0))
+        return false;
+    journal_size=0;
+    return true;
 }
 
-//edit working_path
-void edit_path(char *name[],int n)
+//runs a benchmark ("bench" command)
+bool run_bench(char *what,char *arg)
 {
-    struct working_path *p=&path;
-    if(!~-n)
+//sessions of bench threads take locks of their own; every other benchmark runs alone
+    if(!strcmp(what,"threads")&&0<atoi(arg))
     {
-//parent directory will be next working directory
-        if(!(strcmp(name[0],"..")))
-        {
-            while(NULL!=((p->next)->next))
-                p=p->next;
-            p->next=NULL;
-            return;
-        }
-//root directory will be next working directory
-        if(!strcmp(name[0],"root"))
-        {
-            p->next=NULL;
-            return;
-        }
-//subdirectory will be next working directory
-        while(NULL!=(p->next))
-            p=p->next;
-        struct working_path *new=malloc(sizeof(struct working_path));
-        strcpy(new->name,name[0]);
-        new->next=NULL;
-        p->next=new;
-        return;
+        bench_threads(atoi(arg));
+        return true;
     }
-//working_path will be updated according to the specified path
-    for(int i=1;i<n;i++)
+    bool held=disk_lock(CMD_ALONE,NULL),ok=true;
+    if(!strcmp(what,"dir")&&0<atoi(arg))
+        bench_dir(atoi(arg));
+    else if(!strcmp(what,"io")&&0<atoi(arg))
+        bench_io(atoi(arg));
+    else if(!strcmp(what,"journal")&&0<atoi(arg))
+        bench_journal(atoi(arg));
+    else if(!strcmp(what,"ops")&&0<atoi(arg))
+        bench_ops(atoi(arg));
+    else if(!strcmp(what,"scale")&&0<atoi(arg))
+        bench_scale(atoi(arg));
+    else if(!strcmp(what,"trace")&&strcmp(arg,""))
+        bench_trace(arg);
+    else
     {
-        struct working_path *new=malloc(sizeof(struct working_path));
-        strcpy(new->name,name[i]);
-        new->next=NULL;
-        p->next=new;
-        p=p->next;
+        fprintf(sess->out,"\tusage: bench dir <n> | bench io <kb> | bench journal <n> | bench ops <n> | bench scale <n> | bench trace <file>"
+            " | bench threads <n>\n");
+        ok=false;
     }
-    return;
+    if(held)
+        disk_unlock(CMD_ALONE,-1);
+    return ok;
+}
+
+//prints counters of path resolution cache ("dcache" command)
+bool print_dcache(char *name,char *empty)
+{
+    long long total=dc_hits+dc_misses;
+    fprintf(sess->out,"\thits %lld  misses %lld  hit rate %.1f%%\n",dc_hits,dc_misses,total?100.0*dc_hits/total:0.0);
+    return true;
+}
+
+//frees directories removed with defer ("reclaim" command)
+bool run_reclaim(char *name,char *empty)
+{
+    fprintf(sess->out,"\t%d directories reclaimed\n",reclaim_orphans());
+    return true;
 }
 
-//parent of the parent of current working directory can be found from working_path
-char *get_parent()
+//sets or prints number of commands committed together ("group" command)
+bool run_group(char *n,char *empty)
 {
-    struct working_path *p=&path;
-    char *parent=malloc(MAX_LENGTH*sizeof(char));
-    if(NULL==(p->next)->next)
+    if(!strcmp(n,""))
     {
-        strcpy(parent,"");
-        return parent;
+        fprintf(sess->out,"\tgroup %d  commits %lld  blocks logged %lld\n",group_size,journal_commits,journal_blocks);
+        return true;
     }
-    while(NULL!=(((p->next)->next)->next))
-        p=p->next;
-    strcpy(parent,p->name);
-    return parent;
+    if(0>=atoi(n))
+        return false;
+    group_size=atoi(n);
+    return journal_flush();
 }
 
-//initialize the disk
-bool init()
+//checks consistency of the filesystem ("fsck" command)
+bool run_fsck(char *mode,char *empty)
 {
-    disk=malloc(PARTITION);
-//create superblock
-    add_superblock("superblock");
-//add root directory
-    if(!add_dir("","root"))
+    if(strcmp(mode,"")&&strcmp(mode,"repair"))
+    {
+        fprintf(sess->out,"\tusage: fsck [repair]\n");
         return false;
-//update working directory
-    strcpy(working.name,"root");
-    strcpy(working.parent,"");
-//update working path
-    strcpy(path.name,"root");
-    path.next=NULL;
-    return true;
+    }
+    return fsck(!strcmp(mode,"repair"));
 }
 
-//creates superblock
-bool add_superblock(char *name)
+//prints or zeroes latency of commands and counters of block operations ("stats" command)
+bool run_stats(char *mode,char *empty)
 {
-    struct super_block *sblock=malloc(BLOCKSIZE<<2);
-    sblock->name=malloc(BLOCK*sizeof(*name));
-    int sblock_size=(int)(sizeof(struct super_block)/BLOCKSIZE)+1;
-    for(int i=~-BLOCK;~i;i--)
+    if(!strcmp(mode,"reset"))
     {
-//space taken by superblock
-        if(i<sblock_size)
-        {
-            sblock->Free[i]=false;
-            strcpy(sblock->name[i],name);
-        }
-//space for other files and folders
-        else
-            sblock->Free[i]=true;
-        sblock->type[i]=false;
+        memset(cmd_time,0,sizeof(cmd_time));
+        find_calls=find_scanned=alloc_calls=dealloc_calls=alloc_count=copy_bytes=touch_bytes=0;
+        return true;
+    }
+    if(strcmp(mode,""))
+    {
+        fprintf(sess->out,"\tusage: stats [reset]\n");
+        return false;
     }
-    memcpy(disk,sblock,(BLOCKSIZE*sblock_size));
-    free(sblock);
+    fprintf(sess->out,"\tfind_block %lld calls, %lld index nodes compared\n",find_calls,find_scanned);
+    fprintf(sess->out,"\talloc_block %lld calls, %lld blocks allocated  dealloc_block %lld calls\n",alloc_calls,alloc_count,dealloc_calls);
+    fprintf(sess->out,"\tbytes copied %lld  bytes changed %lld\n",copy_bytes,touch_bytes);
+    stats_table(sess->out);
     return true;
 }
 
-//allocates blocks for files or folders
-int alloc_block(char *name,bool type)
+//takes, drops or lists snapshots ("snapshot" command)
+bool run_snapshot(char *name,char *mode)
 {
-    struct super_block *sblock=malloc(BLOCKSIZE<<2);
-    sblock->name=malloc(BLOCK*sizeof(name));
-    memcpy(sblock,disk,(BLOCKSIZE<<2));
-    for(int i=0;i<BLOCK;i++)
-//find free block
-        if(sblock->Free[i])
+    struct snapshot *s=snapshots;
+    while(NULL!=s&&strcmp(name,s->name))
+        s=s->next;
+    if(!strcmp(name,""))
+    {
+        for(s=snapshots;NULL!=s;s=s->next)
         {
-//allocate the free block to new file or folder and update superblock accordingly
-            sblock->Free[i]=false;
-            sblock->type[i]=type;
-            strcpy(sblock->name[i],name);
-            memcpy(disk,sblock,(BLOCKSIZE<<2));
-            free(sblock);
-            return i;
+            int n=0;
+            for(int k=0;k<snap_count;k++)
+                n+=NULL!=snap_find(snap_list[k],s->epoch);
+            fprintf(sess->out,"\t%-20s %d blocks changed since\n",s->name,n);
         }
-    free(sblock);
-    return -1;
-}
-
-//finds index of specific block with specified type and parent
-int find_block(char *name,char *parent,bool type)
-{
-    struct super_block *sblock=malloc(BLOCKSIZE<<2);
-    memcpy(sblock,disk,(BLOCKSIZE<<2));
-    for(int i=0;i<BLOCK;i++)
-//find matching name
-        if(type==sblock->type[i]&&!strcmp(sblock->name[i],name))
+        fprintf(sess->out,"\t%lld blocks copied (%lld KB)\n",snap_blocks,snap_blocks*block_size>>10);
+        return true;
+    }
+    if(!strcmp(mode,"drop"))
+    {
+        if(NULL==s)
         {
-//checks type
-            if(true==type)
-            {
-                struct folder *dir=malloc(BLOCKSIZE);
-                memcpy(dir,disk+i*BLOCKSIZE,BLOCKSIZE);
-//checks parent
-                if(!strcmp(dir->parent,parent))
-                {
-                    free(dir);
-                    free(sblock);
-                    return i;
-                }
-            }
-            else
-            {
-                struct file *fp=malloc(BLOCKSIZE);
-                memcpy(fp,disk+i*BLOCKSIZE,BLOCKSIZE);
-//chacks parent
-                if(!strcmp(fp->dir_name,parent))
-                {
-                    free(fp);
-                    free(sblock);
-                    return i;
-                }
-            }
+            fprintf(sess->out,"\tNo such snapshot\n");
+            return true;
         }
-    free(sblock);
-    return -1;
-}
-
-//deallocate block by editing super block
-bool dealloc_block(int index)
-{
-    struct super_block *sblock=malloc(BLOCKSIZE<<2);
-    memcpy(sblock,disk,BLOCKSIZE<<2);
-    sblock->Free[index]=true;
-    strcpy(sblock->name[index],"");
-    memcpy(disk,sblock,BLOCKSIZE<<2);
-    free(sblock);
+        snap_drop(s);
+        return true;
+    }
+    if(strcmp(mode,"")||!valid_name(name))
+    {
+        fprintf(sess->out,"\tusage: snapshot [<name> [drop]]\n");
+        return false;
+    }
+    if(NULL!=s)
+    {
+        fprintf(sess->out,"\tSnapshot \"%s\" already exists\n",name);
+        return true;
+    }
+    return snap_take(name);
 }
 
-//adds new directory to the filesystem
-bool add_dir(char *parent,char *name)
+//brings the disk back to a snapshot, which is kept so that it can be restored again ("restore" command)
+bool run_restore(char *name,char *empty)
 {
-//create the folder
-    struct folder *dir=malloc(BLOCKSIZE);
-    strcpy(dir->name,name);
-    strcpy(dir->parent,parent);
-    dir->item=malloc(MAX_DIRECTORY*sizeof(dir->item));
-    dir->item_count=0;
-    int i;
-//allocate block for the folder
-    if(-1==(i=alloc_block(name,true)))
+    struct snapshot *s=snapshots;
+    while(NULL!=s&&strcmp(name,s->name))
+        s=s->next;
+    if(NULL==s)
+    {
+        fprintf(sess->out,"\tNo such snapshot\n");
+        return true;
+    }
+    if(snap_lost)
     {
-        free(dir);
+        fprintf(sess->out,"\trestore: snapshots are incomplete (out of memory)\n");
         return false;
     }
-    memcpy(disk+i*BLOCKSIZE,dir,BLOCKSIZE);
-    free(dir);
+    long long t=now_ns();
+    int n=snap_restore(s);
+    fprintf(sess->out,"\t%s: %d blocks restored, %.3f s\n",name,n,(now_ns()-t)/1e9);
     return true;
 }
 
-//adds file to the filesystem
-bool add_file(char *dir,char *name,char *data)
-{
-//create the file
-    struct file *fp=malloc(BLOCKSIZE);
-    strcpy(fp->name,name);
-    strcpy(fp->dir_name,dir);
-    fp->data_block_count=0;
-    fp->size=(NULL==data?0:atoi(data));
-    int i,j,k;
-//allocate block for the file
-    if(-1==(k=alloc_block(name,false)))
+//runs a script file ("source" command)
+bool run_source(char *file,char *empty)
+{
+    if(MAX_SOURCE_DEPTH<=sess->source_depth)
     {
-        free(fp);
+        fprintf(sess->out,"\tsource: nested too deeply\n");
         return false;
     }
-//allocate block for data
-    char sub[MAX_LENGTH];
-    for(i=(fp->size)/BLOCKSIZE;~i;i--)
+    FILE *in=fopen(file,"r");
+    if(NULL==in)
     {
-        sprintf(sub,"%s[%d]",name,i);
-        if(-1==(j=alloc_block(sub,false)))
-        {
-//if allocation of block failed at any point of time then deallocate all the blocks allocated to this file
-            for(++i;i<(fp->size)/BLOCKSIZE;i++)
-                dealloc_block(fp->data_block[i]);
-            dealloc_block(k);
-            free(fp);
-            return false;
-        }
-        fp->data_block[i]=j;
-        fp->data_block_count++;
+        fprintf(sess->out,"\t%s: cannot open\n",file);
+        return false;
     }
-    memcpy(disk+k*BLOCKSIZE,fp,BLOCKSIZE);
-    free(fp);
+//commands of the file run in batch mode whatever the mode of the shell is
+    bool was=sess->batch;
+    long long cmds=sess->cmd_count,errs=sess->err_count,t=now_ns();
+    sess->batch=true;
+    sess->source_depth++;
+    run_script(in);
+    sess->source_depth--;
+    sess->batch=was;
+    fclose(in);
+    fprintf(sess->out,"\t%s: %lld commands, %lld errors, %.3f s\n",file,sess->cmd_count-cmds,sess->err_count-errs,(now_ns()-t)/1e9);
     return true;
 }
 
+//exit from the program; the disk is released once the running commands end
+bool run_exit(char *name,char *empty)
+{
+    sess->quit=true;
+    return true;
+}
+
+/*-----------------------------------------------------------------------------*/
+/******************************additional functions*****************************/
+
+//splits a line at whitespace outside double quotes in one pass; each word is copied whole to the first half of
+//the arena and in names split at '\\' to the second half, so paths need not be parsed again by the commands
+bool tokenize(char *input,int len,struct line *line,char *arena)
+{
+    char *word=arena,*part=arena+len+1;
+    line->n=line->parts=0;
+    for(int i=0;i<len&&MAX_WORDS>line->n;)
+    {
+//skip whitespace
+        if(' '==input[i]||'\t'==input[i]||'\n'==input[i]||'\r'==input[i])
+        {
+            i++;
+            continue;
+        }
+        struct token *w=&line->word[line->n];
+        w->s=word;
+        line->first[line->n]=line->parts;
+        bool quoted=false;
+        for(char *p=part;;i++)
+        {
+            char ch=i<len?input[i]:'\0';
+//the line ends a word even inside an unterminated quote
+            bool end=!ch||'\n'==ch||'\r'==ch||(!quoted&&(' '==ch||'\t'==ch));
+//a name ends at '\\' or with the word; empty names are skipped
+            if(end||'\\'==ch)
+            {
+                if(p<part)
+                {
+                    if(MAX_PARTS==line->parts)
+                        return false;
+                    line->part[line->parts].s=p;
+                    line->part[line->parts++].len=part-p;
+                    *part++='\0';
+                    p=part;
+                }
+                if(end)
+                    break;
+            }
+            else if('"'==ch)
+            {
+                quoted=!quoted;
+                continue;
+            }
+            else
+                *part++=ch;
+            *word++=ch;
+        }
+        *word++='\0';
+        w->len=word-w->s-1;
+        line->count[line->n]=line->parts-line->first[line->n];
+        line->n++;
+    }
+    return true;
+}
+
+//words of the line being run were split by the tokenizer already; any other argument is taken as a single name
+int path_of(char *arg,struct token **part)
+{
+    static _Thread_local struct token single;
+    for(int i=0;NULL!=sess->cur_line&&i<sess->cur_line->n;i++)
+        if(arg==sess->cur_line->word[i].s)
+        {
+            *part=&sess->cur_line->part[sess->cur_line->first[i]];
+            return sess->cur_line->count[i];
+        }
+    single.s=arg;
+    single.len=strlen(arg);
+    *part=&single;
+    return !!single.len;
+}
+
+//names are kept in fixed size fields; an empty name, one with '\\', "." or ".." could never be looked up again
+bool valid_name(char *name)
+{
+    if(!*name||NULL!=strchr(name,'\\'))
+    {
+        fprintf(sess->out,"\tname \"%s\" is empty or contains '\\'\n",name);
+        return false;
+    }
+    if(!strcmp(name,".")||!strcmp(name,".."))
+    {
+        fprintf(sess->out,"\tname \"%s\" is kept for paths\n",name);
+        return false;
+    }
+    if(strlen(name)<(size_t)name_length)
+        return true;
+    fprintf(sess->out,"\tname \"%s\" is longer than %d characters\n",name,name_length-1);
+    return false;
+}
+
+//prompt is rendered when path changes
+void print_path()
+{
+    fwrite(sess->path.prompt,1,sess->path.end[sess->path.depth-1]+2,sess->out);
+}
+
+//appends "\\name" over the "> " at the end of prompt
+bool path_push(int d)
+{
+    if(!path_reserve(-~sess->path.depth))
+        return false;
+    int at=sess->path.depth?sess->path.end[sess->path.depth-1]:0;
+    at+=sprintf(sess->path.prompt+at,"\\%s> ",get_name(d))-2;
+    sess->path.inode[sess->path.depth]=d;
+    sess->path.end[sess->path.depth++]=at;
+    sess->working=d;
+    return true;
+}
+
+//cuts prompt back to the end of the parent
+void path_pop()
+{
+    sess->working=sess->path.inode[--sess->path.depth-1];
+    strcpy(sess->path.prompt+sess->path.end[sess->path.depth-1],"> ");
+}
+
+//collects ancestors by walking parent links and pushes them from root
+bool path_set(int d)
+{
+    int n=0;
+    for(int i=d;-1!=i;i=get_folder(i)->parent)
+        n++;
+    if(!path_reserve(n))
+        return false;
+    for(int i=d,k=n;-1!=i;i=get_folder(i)->parent)
+        sess->path.inode[--k]=i;
+    sess->path.depth=0;
+    for(int k=0;k<n;k++)
+        path_push(sess->path.inode[k]);
+    return true;
+}
+
+//grows the arrays by doubling; every name takes at most name_length bytes of prompt with its '\\'
+bool path_reserve(int n)
+{
+    if(n<=sess->path.cap)
+        return true;
+    int cap=sess->path.cap?sess->path.cap:16;
+    while(cap<n)
+        cap<<=1;
+    int *inode=realloc(sess->path.inode,cap*sizeof(int)),*end;
+    if(NULL!=inode)
+        sess->path.inode=inode;
+    if(NULL==inode||NULL==(end=realloc(sess->path.end,cap*sizeof(int))))
+        return false;
+    sess->path.end=end;
+    char *prompt=realloc(sess->path.prompt,(size_t)cap*name_length+3);
+    if(NULL==prompt)
+        return false;
+    sess->path.prompt=prompt;
+    sess->path.cap=cap;
+    return true;
+}
+
+//a session starts in root and is listed so that directories it is in are not removed under it
+bool session_open(struct session *s,FILE *out,bool batch)
+{
+    struct session *was=sess;
+    *s=(struct session){0};
+    s->out=out;
+    s->batch=batch;
+    sess=s;
+    pthread_rwlock_rdlock(&disk_rw);
+    s->gen=tree_gen;
+    bool ok=path_set(get_sblock()->root);
+    pthread_rwlock_unlock(&disk_rw);
+    sess=was;
+    if(!ok)
+        return false;
+    pthread_mutex_lock(&session_mx);
+    s->next=sessions;
+    sessions=s;
+    pthread_mutex_unlock(&session_mx);
+    return true;
+}
+
+void session_close(struct session *s)
+{
+    pthread_mutex_lock(&session_mx);
+    struct session **p=&sessions;
+    while(NULL!=*p&&s!=*p)
+        p=&(*p)->next;
+    if(NULL!=*p)
+        *p=s->next;
+    pthread_mutex_unlock(&session_mx);
+    free(s->path.inode);
+    free(s->path.end);
+    free(s->path.prompt);
+}
+
+//only commands run alone remove directories, so working directories of the other sessions stay put meanwhile
+bool dir_in_use(int d)
+{
+    bool used=false;
+    pthread_mutex_lock(&session_mx);
+    for(struct session *s=sessions;!used&&NULL!=s;s=s->next)
+        for(int i=s->working;!used&&-1!=i;i=get_folder(i)->parent)
+            used=i==d;
+    pthread_mutex_unlock(&session_mx);
+    return used;
+}
+
+//directories share DIR_LOCKS locks by inode; a command holds at most one of them, so sharing cannot deadlock. The
+//working directory is read only under disk_rw, since restore moves sessions whose directory is gone back to root
+bool disk_lock(int mode,int *d)
+{
+//commands run from a command which runs alone are covered by its lock
+    if(CMD_FREE==mode||sess->alone)
+    {
+        if(NULL!=d)
+            *d=sess->working;
+        return false;
+    }
+    if(CMD_ALONE==mode)
+    {
+        pthread_rwlock_wrlock(&disk_rw);
+        sess->alone=true;
+    }
+    else
+        pthread_rwlock_rdlock(&disk_rw);
+//a directory of the path may have been renamed or moved since the prompt was rendered
+    if(sess->gen!=tree_gen)
+    {
+        sess->gen=tree_gen;
+        path_set(sess->working);
+    }
+    if(NULL!=d)
+        *d=sess->working;
+    if(CMD_READ==mode)
+        pthread_rwlock_rdlock(&dir_rw[*d%DIR_LOCKS]);
+    else if(CMD_WRITE==mode)
+        pthread_rwlock_wrlock(&dir_rw[*d%DIR_LOCKS]);
+    return true;
+}
+
+void disk_unlock(int mode,int d)
+{
+    if(CMD_READ==mode||CMD_WRITE==mode)
+        pthread_rwlock_unlock(&dir_rw[d%DIR_LOCKS]);
+    sess->alone=false;
+    pthread_rwlock_unlock(&disk_rw);
+}
+
+//initialize the disk
+bool init(char *image)
+{
+    bool fresh=true;
+    struct stat st;
+    if(NULL!=image)
+    {
+        if(-1==(disk_fd=open(image,O_RDWR|O_CREAT,0644))||-1==fstat(disk_fd,&st))
+            return false;
+//bring the image up to date with the journal before looking at it; a new image file is empty
+        char *journal=malloc(strlen(image)+sizeof(".journal"));
+        if(NULL==journal)
+            return false;
+        sprintf(journal,"%s.journal",image);
+        journal_fd=open(journal,O_RDWR|O_CREAT,0644);
+        free(journal);
+        fresh=!st.st_size;
+        if(-1==journal_fd||!(fresh?!ftruncate(journal_fd,0):journal_replay(disk_fd,journal_fd)))
+            return false;
+//an existing image keeps the geometry it was formatted with and must hold all of its blocks
+        struct super_block head;
+        if(!fresh&&!(sizeof(head)==pread(disk_fd,&head,sizeof(head),0)&&FS_MAGIC==head.magic&&FS_VERSION==head.version
+            &&0<head.block_size&&0<head.block_count&&(long long)head.block_size*head.block_count==st.st_size))
+        {
+            fprintf(sess->out,"\t%s: not a disk image\n",image);
+            return false;
+        }
+        if(!fresh)
+        {
+            partition=st.st_size;
+            block_size=head.block_size;
+            name_length=head.name_length;
+        }
+    }
+    if(!set_geometry(partition,block_size,name_length))
+        return false;
+    if(NULL==image)
+    {
+        if(NULL==(disk=malloc(partition)))
+            return false;
+    }
+//changes stay private to the mapping; they reach the image file only by journal_flush
+    else if((fresh&&-1==ftruncate(disk_fd,partition))||MAP_FAILED==(disk=mmap(NULL,partition,PROT_READ|PROT_WRITE,MAP_PRIVATE,disk_fd,0)))
+        return false;
+//bitmap, kinds and names follow the header of the superblock
+    free_map=(unsigned long long *)(disk+((sizeof(struct super_block)+7)&~7));
+    block_type=(char *)(free_map+map_words);
+    block_name=block_type+block_count;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&alloc_mx,&attr);
+    for(int i=0;i<DIR_LOCKS;i++)
+        pthread_rwlock_init(&dir_rw[i],NULL);
+    dc_init();
+    bc_init();
+    fmap.file=ra_file=-1;
+    if(!(fresh?format():mount()))
+        return false;
+//formatting and recovery are committed at once
+    return journal_flush();
+}
+
+//every size derived from the geometry is computed once, together with the in-memory tables which depend on it
+bool set_geometry(long long size,int bsize,int nlen)
+{
+    entry_size=0<nlen&&nlen<=MAX_NAME?(int)((sizeof(struct dir_entry)+nlen+3)&~3):1;
+    head_items=(bsize-(int)sizeof(struct folder))/entry_size;
+    block_items=(bsize-(int)sizeof(struct item_block))/entry_size;
+    head_extents=(bsize-(int)sizeof(struct file))/(int)sizeof(struct extent);
+    block_extents=(bsize-(int)sizeof(struct extent_block))/(int)sizeof(struct extent);
+    block_count=0<bsize&&size/bsize<=(1LL<<30)?(int)(size/bsize):0;
+    map_words=(block_count+63)>>6;
+    sblock_size=block_count?(int)((((sizeof(struct super_block)+7)&~7)+map_words*8+(size_t)block_count*(nlen+1)+bsize-1)/bsize):0;
+//a block must hold at least one item or extent, and the superblock must leave room for the root and its items;
+//headers and the bitmap are read in place from block offsets, so blocks are a multiple of 8 bytes
+    if(bsize%8||2>nlen||MAX_NAME<nlen||1>head_items||1>block_items||1>head_extents||1>block_extents||block_count<sblock_size+2)
+    {
+        fprintf(sess->out,"\tunusable geometry: %lld bytes, blocks of %d bytes, names of %d bytes\n",size,bsize,nlen);
+        if(bsize%8)
+            fprintf(sess->out,"\tusage: the size of a block (-s) must be a multiple of 8\n");
+        return false;
+    }
+    partition=(long long)block_count*bsize;
+    block_size=bsize;
+    name_length=nlen;
+    char *names=malloc((size_t)DCACHE_SIZE*nlen),*data=malloc((size_t)BCACHE_SIZE*bsize);
+    idx_node=malloc(block_count*sizeof(struct index_node));
+    idx_head=malloc(block_count*sizeof(int));
+    dirty_map=calloc(map_words,sizeof(unsigned long long));
+    dirty_list=malloc(block_count*sizeof(int));
+    journal_buf=malloc(JOURNAL_CHUNK*(sizeof(int)+bsize));
+    if(NULL==names||NULL==data||NULL==idx_node||NULL==idx_head||NULL==dirty_map||NULL==dirty_list||NULL==journal_buf)
+        return false;
+    for(int i=0;i<DCACHE_SIZE;i++)
+        dcache[i].name=names+(size_t)i*nlen;
+    for(int i=0;i<BCACHE_SIZE;i++)
+        bcache[i].data=data+(size_t)i*bsize;
+    return true;
+}
+
+//unmount the image
+void unmount()
+{
+    run_sync("","");
+    if(-1!=disk_fd)
+    {
+        munmap(disk,partition);
+        close(disk_fd);
+        close(journal_fd);
+    }
+}
+
+//creates superblock and root directory
+bool format()
+{
+//create superblock
+    if(!add_superblock("superblock"))
+        return false;
+//build block index
+    if(!build_index())
+        return false;
+//add root directory
+    return -1!=(get_sblock()->root=add_dir(-1,"root"));
+}
+
+//checks superblock of an existing image and rebuilds in-memory state
+bool mount()
+{
+    struct super_block *sblock=get_sblock();
+    if(FS_MAGIC!=sblock->magic||FS_VERSION!=sblock->version||block_size!=sblock->block_size||block_count!=sblock->block_count||name_length!=sblock->name_length)
+    {
+        fprintf(sess->out,"\tunsupported disk image\n");
+        return false;
+    }
+//finish removals which were deferred before the disk was unmounted
+    if(!build_index())
+        return false;
+    reclaim_orphans();
+    return true;
+}
+
+//creates superblock
+bool add_superblock(char *name)
+{
+    struct super_block *sblock=get_sblock();
+    touch(sblock,sizeof(struct super_block));
+    sblock->magic=FS_MAGIC;
+    sblock->version=FS_VERSION;
+    sblock->block_size=block_size;
+    sblock->block_count=block_count;
+    sblock->name_length=name_length;
+//names of other blocks are written when they are allocated
+    touch(free_map,map_words*sizeof(free_map[0]));
+    touch(block_type,block_count);
+    touch(block_name,(size_t)sblock_size*name_length);
+    memset(free_map,0,map_words*sizeof(free_map[0]));
+    for(int i=~-block_count;~i;i--)
+    {
+//space taken by superblock
+        if(i<sblock_size)
+            strcpy(get_name(i),name);
+//space for other files and folders
+        else
+            free_map[i>>6]|=1ULL<<(i&63);
+        block_type[i]=BLK_SUPER;
+    }
+    sblock->free_count=block_count-sblock_size;
+    sblock->next_fit=sblock_size;
+    sblock->orphan=-1;
+    return true;
+}
+
+//allocates blocks for files or folders
+//parent is -1 for blocks which are not looked up by name (root, item and extent blocks)
+int alloc_block(char *name,int parent,int type)
+{
+    struct super_block *sblock=get_sblock();
+    pthread_mutex_lock(&alloc_mx);
+    alloc_calls++;
+//find free block starting from where the last allocation ended
+    int i=next_free(sblock->next_fit);
+//space held by deferred removals is given back before failing
+    if(-1==i&&(!reclaim_orphans()||-1==(i=next_free(sblock->next_fit))))
+    {
+        pthread_mutex_unlock(&alloc_mx);
+        return -1;
+    }
+//allocate the free block to new file or folder and update superblock accordingly
+    touch(&free_map[i>>6],sizeof(free_map[0]));
+    touch(&sblock->free_count,sizeof(int));
+    touch(&sblock->next_fit,sizeof(int));
+    touch(&block_type[i],1);
+    touch(get_name(i),name_length);
+    free_map[i>>6]&=~(1ULL<<(i&63));
+    sblock->free_count--;
+    sblock->next_fit=(i+1)%block_count;
+    block_type[i]=type;
+    strcpy(get_name(i),name);
+    if(-1!=parent)
+        index_add(i,name,parent,type);
+    alloc_count++;
+    pthread_mutex_unlock(&alloc_mx);
+    return i;
+}
+
+//allocates n data blocks; the last extent is continued first, then a single run of the rest is preferred, otherwise free runs are taken in order
+bool alloc_blocks(struct file *fp,int n)
+{
+    struct super_block *sblock=get_sblock();
+    pthread_mutex_lock(&alloc_mx);
+    if(n>sblock->free_count&&(!reclaim_orphans()||n>sblock->free_count))
+    {
+        pthread_mutex_unlock(&alloc_mx);
+        return false;
+    }
+    int i;
+    bool ok=true;
+    if(fp->extent_count&&(i=tail_extent(fp)->start+tail_extent(fp)->length)<block_count&&free_map[i>>6]>>(i&63)&1)
+    {
+        int len=next_used(i)-i;
+        if(len>n)
+            len=n;
+        mark_blocks(i,len,false);
+        add_extent(fp,i,len);
+        n-=len;
+    }
+    if(n&&-1!=(i=find_run(sblock->next_fit,n)))
+    {
+        mark_blocks(i,n,false);
+        touch(&sblock->next_fit,sizeof(int));
+        sblock->next_fit=(i+n)%block_count;
+        ok=add_extent(fp,i,n);
+        n=0;
+    }
+    while(ok&&n)
+    {
+//extent blocks may have taken the last free blocks
+        if(-1==(i=next_free(sblock->next_fit)))
+        {
+            ok=false;
+            break;
+        }
+        int len=next_used(i)-i;
+        if(len>n)
+            len=n;
+        mark_blocks(i,len,false);
+        touch(&sblock->next_fit,sizeof(int));
+        sblock->next_fit=(i+len)%block_count;
+        n-=len;
+        ok=add_extent(fp,i,len);
+    }
+    pthread_mutex_unlock(&alloc_mx);
+    return ok;
+}
+
+//searches the bitmap a word at a time
+int next_free(int from)
+{
+    int w=from>>6;
+//ignore blocks before <from> in the first word; they are seen again after wrapping around
+    unsigned long long bits=free_map[w]&(~0ULL<<(from&63));
+    for(int n=map_words;;w=-~w%map_words,bits=free_map[w])
+    {
+        if(bits)
+            return w<<6|__builtin_ctzll(bits);
+        if(!n--)
+            return -1;
+    }
+}
+
+//pops blocks from the end of the last extents; an extent block is released as soon as it holds no extent
+void free_blocks(struct file *fp,int n)
+{
+    fmap_forget();
+    touch(fp,sizeof(struct file));
+    while(n)
+    {
+        struct extent *ext=tail_extent(fp);
+        int len=ext->length<n?ext->length:n;
+        touch(ext,sizeof(struct extent));
+        ext->length-=len;
+        mark_blocks(ext->start+ext->length,len,true);
+        fp->block_count-=len;
+        n-=len;
+        if(ext->length)
+            break;
+//drop the emptied extent
+        int i=--(fp->extent_count)-head_extents;
+        if(0<=i&&!(i%block_extents))
+        {
+            int b=fp->last_block;
+            fp->last_block=get_extent_block(b)->prev;
+            if(-1==fp->last_block)
+                fp->first_block=-1;
+            else
+            {
+                touch(get_extent_block(fp->last_block),sizeof(struct extent_block));
+                get_extent_block(fp->last_block)->next=-1;
+            }
+            dealloc_block(b);
+        }
+    }
+}
+
+//same as next_free on the complemented bitmap, without wrapping around
+int next_used(int from)
+{
+    if(block_count<=from)
+        return block_count;
+    int w=from>>6;
+    unsigned long long bits=~free_map[w]&(~0ULL<<(from&63));
+    while(!bits)
+    {
+        if(map_words==++w)
+            return block_count;
+        bits=~free_map[w];
+    }
+    from=w<<6|__builtin_ctzll(bits);
+    return from<block_count?from:block_count;
+}
+
+//walks free runs from <from>; the run holding <from> is seen once more in full after wrapping around
+int find_run(int from,int n)
+{
+    int i=next_free(from);
+    for(int seen=0,end;-1!=i&&seen<get_sblock()->free_count;i=next_free(end%block_count))
+    {
+        end=next_used(i);
+        if(end-i>=n)
+            return i;
+        seen+=end-i;
+    }
+    return -1;
+}
+
+//updates the bitmap a word at a time; data blocks carry no name in the superblock
+void mark_blocks(int start,int n,bool free)
+{
+    struct super_block *sblock=get_sblock();
+    pthread_mutex_lock(&alloc_mx);
+    touch(&free_map[start>>6],(((start+n-1)>>6)-(start>>6)+1)*sizeof(free_map[0]));
+    touch(&sblock->free_count,sizeof(int));
+    for(int i=start,end=start+n;i<end;)
+    {
+        int w=i>>6,lo=i&63,hi=end-(w<<6)<64?end-(w<<6):64;
+        unsigned long long mask=(64==hi-lo?~0ULL:((1ULL<<(hi-lo))-1)<<lo);
+        if(free)
+            free_map[w]|=mask;
+        else
+            free_map[w]&=~mask;
+        i=(w<<6)+hi;
+    }
+    sblock->free_count+=free?n:-n;
+//cached data of freed blocks is stale; new blocks are zeroed only when they are first read, so they are not journaled
+    if(free)
+    {
+        pthread_mutex_lock(&bc_mx);
+        bc_forget(start,n);
+        pthread_mutex_unlock(&bc_mx);
+    }
+    else
+    {
+        touch(block_type+start,n);
+        memset(block_type+start,BLK_FRESH,n);
+        alloc_count+=n;
+    }
+    pthread_mutex_unlock(&alloc_mx);
+}
+
+//finds index of specific block with specified type and parent
+int find_block(char *name,int parent,bool type)
+{
+    int len,i,n=0;
+    unsigned hash=hash_key(name,parent,type,&len);
+    pthread_rwlock_rdlock(&index_rw);
+//walk the bucket chain comparing full key; names are compared only if their lengths match
+    for(i=idx_head[hash%block_count];~i;i=idx_node[i].next)
+        if(n++,hash==idx_node[i].hash&&len==idx_node[i].len&&parent==idx_node[i].parent&&type==idx_node[i].type&&!memcmp(get_name(i),name,len))
+            break;
+    pthread_rwlock_unlock(&index_rw);
+    count(&find_calls,1);
+    count(&find_scanned,n);
+    return i;
+}
+
+//resolves an absolute path one component at a time
+int find_dir(struct token *name,int n)
+{
+    if(4!=name[0].len||memcmp(name[0].s,"root",4))
+        return -1;
+    int d=get_sblock()->root;
+    for(int i=1;i<n&&-1!=d;i++)
+        d=lookup_locked(d,name[i].s,true);
+    return d;
+}
+
+//deallocate block by editing super block
+bool dealloc_block(int index)
+{
+    struct super_block *sblock=get_sblock();
+//the name is cleared only once no lookup can reach it
+    index_del(index);
+    pthread_mutex_lock(&alloc_mx);
+    dealloc_calls++;
+    if(!(free_map[index>>6]>>(index&63)&1))
+    {
+        touch(&free_map[index>>6],sizeof(free_map[0]));
+        touch(&sblock->free_count,sizeof(int));
+        free_map[index>>6]|=1ULL<<(index&63);
+        sblock->free_count++;
+    }
+    touch(get_name(index),name_length);
+    strcpy(get_name(index),"");
+    pthread_mutex_unlock(&alloc_mx);
+    return true;
+}
+
+//adds new directory to the filesystem
+int add_dir(int parent,char *name)
+{
+    int i;
+//allocate block for the folder
+    if(-1==(i=alloc_block(name,parent,true)))
+        return -1;
+//create the folder in its block
+    struct folder *dir=get_folder(i);
+    touch(dir,sizeof(struct folder));
+    dir->parent=parent;
+    dir->entry_block=-1;
+    dir->item_count=0;
+    dir->first_block=dir->last_block=-1;
+    return i;
+}
+
+//adds file to the filesystem
+int add_file(int dir,char *name,char *data)
+{
+    int size=(NULL==data?0:atoi(data));
+    int k;
+//allocate block for the file
+    if(0>size||-1==(k=alloc_block(name,dir,false)))
+        return -1;
+//create the file in its block
+    struct file *fp=get_file(k);
+    touch(fp,sizeof(struct file));
+    fp->dir=dir;
+    fp->size=fp->block_count=fp->extent_count=0;
+    fp->first_block=fp->last_block=-1;
+//allocate all blocks for data at once
+    if(!resize_file(k,size))
+    {
+//if allocation failed then release whatever was allocated to this file
+        del_file(k);
+        return -1;
+    }
+    return k;
+}
+
 //add or remove item from item list
-void edit_dir(char *cur_par,char *cur_dir,char *name,bool type,bool add)
+bool edit_dir(int d,int c,bool add)
+{
+    struct folder *dir=get_folder(d);
+//add=true means add the item at the end of item list
+    if(add)
+    {
+        int b=d,s=dir->item_count;
+//the header changes below when an item block is added, so it is copied for the snapshots first
+        touch(dir,sizeof(struct folder));
+        if(head_items<=s)
+        {
+            b=dir->last_block;
+            s=(s-head_items)%block_items;
+//first item of an item block needs a new block at the end of the chain
+            if(!s)
+            {
+                int k=alloc_block("",-1,BLK_ITEM);
+                if(-1==k)
+                    return false;
+                touch(get_item_block(k),sizeof(struct item_block));
+                get_item_block(k)->prev=b;
+                get_item_block(k)->next=-1;
+                if(-1==b)
+                    dir->first_block=k;
+                else
+                {
+                    touch(get_item_block(b),sizeof(struct item_block));
+                    get_item_block(b)->next=k;
+                }
+                dir->last_block=b=k;
+            }
+        }
+        struct dir_entry *item=entry_at(b,s);
+        touch(item,entry_size);
+        strcpy(item->name,get_name(c));
+        item->type=BLK_FOLDER==block_type[c];
+        dc_forget(d,item->name,item->type);
+        item->inode=c;
+        set_entry(c,b,s);
+        dir->item_count++;
+        return true;
+    }
+//add=false means remove the item
+    if(BLK_FOLDER==block_type[c])
+        drop_entry(d,get_folder(c)->entry_block,get_folder(c)->entry_slot);
+    else
+        drop_entry(d,get_file(c)->entry_block,get_file(c)->entry_slot);
+    return true;
+}
+
+//moves last item to the slot and decreases item count
+void drop_entry(int d,int b,int s)
+{
+    struct folder *dir=get_folder(d);
+    dc_forget(d,entry_at(b,s)->name,entry_at(b,s)->type);
+    touch(dir,sizeof(struct folder));
+    int lb=d,ls=--(dir->item_count);
+    if(head_items<=ls)
+    {
+        lb=dir->last_block;
+        ls=(ls-head_items)%block_items;
+    }
+    if(b!=lb||s!=ls)
+    {
+        struct dir_entry *last=entry_at(lb,ls);
+        touch(entry_at(b,s),entry_size);
+        memcpy(entry_at(b,s),last,entry_size);
+        count(&copy_bytes,entry_size);
+        set_entry(last->inode,b,s);
+    }
+//release last item block if it became empty
+    if(lb!=d&&!ls)
+    {
+        dir->last_block=get_item_block(lb)->prev;
+        if(-1==dir->last_block)
+            dir->first_block=-1;
+        else
+        {
+            touch(get_item_block(dir->last_block),sizeof(struct item_block));
+            get_item_block(dir->last_block)->next=-1;
+        }
+        dealloc_block(lb);
+    }
+}
+
+//the new item is linked before the old one is unlinked, so a failure leaves the item where it was
+bool relink(int c,int d)
+{
+    bool type=BLK_FOLDER==block_type[c];
+    int p,b,s;
+    if(type)
+    {
+        p=get_folder(c)->parent;
+        b=get_folder(c)->entry_block;
+        s=get_folder(c)->entry_slot;
+    }
+    else
+    {
+        p=get_file(c)->dir;
+        b=get_file(c)->entry_block;
+        s=get_file(c)->entry_slot;
+    }
+    if(!edit_dir(d,c,true))
+        return false;
+    drop_entry(p,b,s);
+    touch(get_folder(c),type?sizeof(struct folder):sizeof(struct file));
+    if(type)
+        get_folder(c)->parent=d;
+    else
+        get_file(c)->dir=d;
+    index_del(c);
+    index_add(c,get_name(c),d,type);
+    return true;
+}
+
+//edits a file size
+bool edit_file(char *name, char *data)
+{
+    int c=lookup(sess->working,name,false);
+    if(-1==c)
+    {
+        fprintf(sess->out,"\tNo such file\n");
+        return true;
+    }
+    int size=atoi(data);
+    if(0>size)
+        return false;
+    return resize_file(c,size);
+}
+
+//truncates or extends a file in place
+bool resize_file(int c,int size)
+{
+    struct file *fp=get_file(c);
+//sizes near INT_MAX would overflow the block count; a file can never need more blocks than the disk has
+    long long n=((long long)size+block_size-1)/block_size;
+    int old=fp->block_count;
+    if(0>size||block_count<n)
+        return false;
+//bytes past the old end of its last block must read as zeros once the file grows over them
+    if(size>fp->size&&fp->size%block_size)
+    {
+        pthread_mutex_lock(&bc_mx);
+        struct buffer *buf=bc_get(file_block(c,fp->size/block_size),true);
+        memset(buf->data+fp->size%block_size,0,block_size-fp->size%block_size);
+        buf->dirty=true;
+        pthread_mutex_unlock(&bc_mx);
+    }
+    if(n<old)
+        free_blocks(fp,old-n);
+    else if(n>old&&!alloc_blocks(fp,n-old))
+    {
+//if allocation failed then give back the blocks it managed to take
+        free_blocks(fp,fp->block_count-old);
+        return false;
+    }
+    touch(fp,sizeof(struct file));
+    fp->size=size;
+    return true;
+}
+
+//copies data out of the buffer cache block by block; reading the block after the previous one reads ahead
+int read_data(int c,int off,char *buf,int n)
+{
+    struct file *fp=get_file(c);
+    if(off>=fp->size)
+        return 0;
+    if(n>fp->size-off)
+        n=fp->size-off;
+    pthread_mutex_lock(&bc_mx);
+    for(int done=0,len;done<n;done+=len,off+=len)
+    {
+        int k=off/block_size,o=off%block_size;
+        len=block_size-o<n-done?block_size-o:n-done;
+        memcpy(buf+done,bc_get(file_block(c,k),true)->data+o,len);
+        count(&copy_bytes,len);
+        if(c==ra_file&&k==ra_block)
+        {
+//sequential access; load following blocks which are not cached before they are asked for
+            for(int j=1,b;j<=READ_AHEAD&&k+j<fp->block_count;j++)
+                if(-1==bc_find(b=file_block(c,k+j)))
+                    bc_get(b,true);
+        }
+        ra_file=c;
+        ra_block=-~k;
+    }
+    pthread_mutex_unlock(&bc_mx);
+    return n;
+}
+
+//copies data into the buffer cache block by block; blocks which are overwritten entirely are not read from disk
+bool write_data(int c,int off,char *buf,int n)
+{
+    if(INT_MAX-n<off||(off+n>get_file(c)->size&&!resize_file(c,off+n)))
+        return false;
+    pthread_mutex_lock(&bc_mx);
+    for(int done=0,len;done<n;done+=len,off+=len)
+    {
+        int o=off%block_size;
+        len=block_size-o<n-done?block_size-o:n-done;
+        struct buffer *b=bc_get(file_block(c,off/block_size),block_size!=len);
+        memcpy(b->data+o,buf+done,len);
+        count(&copy_bytes,len);
+        b->dirty=true;
+    }
+    pthread_mutex_unlock(&bc_mx);
+    return true;
+}
+
+//renames a file or folder
+void r_name(int c,char *new_name)
+{
+    bool type=BLK_FOLDER==block_type[c];
+    int parent=type?get_folder(c)->parent:get_file(c)->dir;
+    int b,s;
+//both names change their meaning in parent directory
+    dc_forget(parent,get_name(c),type);
+    dc_forget(parent,new_name,type);
+//update superblock
+    touch(get_name(c),name_length);
+    strcpy(get_name(c),new_name);
+    if(type)
+    {
+        b=get_folder(c)->entry_block;
+        s=get_folder(c)->entry_slot;
+    }
+    else
+    {
+        b=get_file(c)->entry_block;
+        s=get_file(c)->entry_slot;
+    }
+//update its item in parent directory and the block index
+    touch(entry_at(b,s),entry_size);
+    strcpy(entry_at(b,s)->name,new_name);
+    index_del(c);
+    index_add(c,new_name,parent,type);
+}
+
+//checks existance of a file or folder
+bool ch_exist(int dir,char *name,bool type)
+{
+    return -1!=lookup(dir,name,type);
+}
+
+
+//deletes file from the filesystem
+bool del_file(int c)
+{
+    struct file *fp=get_file(c);
+    fmap_forget();
+//deallocate all data blocks one extent at a time
+    for(int i=0,b=-1;i<fp->extent_count;i++)
+    {
+        struct extent *ext=walk_extent(fp,i,&b);
+        mark_blocks(ext->start,ext->length,true);
+    }
+//deallocate extent blocks and the file block
+    for(int b=fp->first_block,next;~b;b=next)
+    {
+        next=get_extent_block(b)->next;
+        dealloc_block(b);
+    }
+    return dealloc_block(c);
+}
+
+//delete directory from the filesystem; blocks of the whole subtree are collected in one traversal and freed together
+bool del_dir(int d)
+{
+    struct reclaim r={NULL,0,0,NULL,0,0};
+    bool ok=reclaim_push(&r,d);
+    while(ok&&r.top)
+    {
+        int f=r.dir[--r.top];
+        struct folder *dir=get_folder(f);
+//visit subitems; subdirectories are visited later from the stack
+        for(int i=0,b=-1;ok&&i<dir->item_count;i++)
+        {
+            struct dir_entry *item=walk_item(dir,i,&b);
+            dc_forget(f,item->name,item->type);
+            index_del(item->inode);
+            ok=item->type?reclaim_push(&r,item->inode):reclaim_file(&r,item->inode);
+        }
+//item blocks and the folder block
+        for(int b=dir->first_block;ok&&~b;b=get_item_block(b)->next)
+            ok=reclaim_add(&r,b,1);
+        index_del(f);
+        ok=ok&&reclaim_add(&r,f,1);
+    }
+    if(ok)
+        release_blocks(r.run,r.n);
+    free(r.run);
+    free(r.dir);
+    return ok;
+}
+
+//arrays grow by doubling
+bool reclaim_add(struct reclaim *r,int start,int n)
+{
+    if(r->n&&start==r->run[r->n-1].start+r->run[r->n-1].length)
+    {
+        r->run[r->n-1].length+=n;
+        return true;
+    }
+    if(r->n==r->cap)
+    {
+        struct extent *run=realloc(r->run,(r->cap=r->cap?r->cap<<1:64)*sizeof(struct extent));
+        if(NULL==run)
+            return false;
+        r->run=run;
+    }
+    r->run[r->n].start=start;
+    r->run[r->n++].length=n;
+    return true;
+}
+
+bool reclaim_push(struct reclaim *r,int d)
+{
+    if(r->top==r->dir_cap)
+    {
+        int *dir=realloc(r->dir,(r->dir_cap=r->dir_cap?r->dir_cap<<1:64)*sizeof(int));
+        if(NULL==dir)
+            return false;
+        r->dir=dir;
+    }
+    r->dir[r->top++]=d;
+    return true;
+}
+
+//data extents, extent blocks and the file block
+bool reclaim_file(struct reclaim *r,int c)
+{
+    struct file *fp=get_file(c);
+    fmap_forget();
+    bool ok=true;
+    for(int i=0,b=-1;ok&&i<fp->extent_count;i++)
+    {
+        struct extent *ext=walk_extent(fp,i,&b);
+        ok=reclaim_add(r,ext->start,ext->length);
+    }
+    for(int b=fp->first_block;ok&&~b;b=get_extent_block(b)->next)
+        ok=reclaim_add(r,b,1);
+    return ok&&reclaim_add(r,c,1);
+}
+
+//sorting lets neighbouring runs merge, so the bitmap is swept once in order of address
+void release_blocks(struct extent *run,int n)
+{
+    qsort(run,n,sizeof(struct extent),cmp_extent);
+    for(int i=0,j;i<n;i=j)
+    {
+        int start=run[i].start,end=start+run[i].length;
+        for(j=-~i;j<n&&run[j].start==end;j++)
+            end+=run[j].length;
+        mark_blocks(start,end-start,true);
+    }
+}
+
+int cmp_extent(const void *a,const void *b)
+{
+    return ((const struct extent *)a)->start-((const struct extent *)b)->start;
+}
+
+//orphans are taken off the list before being freed, so an interrupted reclaim can leak blocks but never free them twice
+int reclaim_orphans()
+{
+    struct super_block *sblock=get_sblock();
+    int n=0;
+    for(int d;-1!=(d=sblock->orphan);n++)
+    {
+        touch(&sblock->orphan,sizeof(int));
+        sblock->orphan=get_folder(d)->entry_block;
+        del_dir(d);
+    }
+    return n;
+}
+
+//every block is reached at most once from root and the orphan list, then the bitmap is swept once, so the check
+//takes time linear in block_count; blocks are claimed only after they are known to be what their owner says they are
+bool fsck(bool repair)
+{
+    struct super_block *sblock=get_sblock();
+    struct check k={calloc(map_words,sizeof(unsigned long long)),malloc(block_count*sizeof(int)),0,0,NULL,0,0,repair,0,0,0,0};
+    bool ok=NULL!=k.seen&&NULL!=k.queue;
+    bc_flush();
+    if(ok)
+        check_claim(&k,0,sblock_size);
+//without a root nothing can be told reachable, so nothing is repaired
+    int root=sblock->root;
+    if(ok&&!check_run(&k,root,1,BLK_FOLDER))
+    {
+        check_report(&k,false,"root directory %d is not a folder",root);
+        ok=false;
+    }
+    if(ok)
+    {
+        check_claim(&k,root,1);
+        k.queue[k.tail++]=root;
+        if(-1!=get_folder(root)->parent)
+        {
+            check_report(&k,repair,"root directory has parent %d",get_folder(root)->parent);
+            if(repair)
+            {
+                touch(get_folder(root),sizeof(struct folder));
+                get_folder(root)->parent=-1;
+            }
+        }
+//directories removed with defer are still owned by the filesystem
+        for(int *link=&sblock->orphan;-1!=*link;link=&get_folder(*link)->entry_block)
+        {
+            if(!check_node(&k,*link,BLK_FOLDER))
+            {
+                check_report(&k,repair,"orphan list broken at block %d",*link);
+                if(repair)
+                {
+                    touch(link,sizeof(int));
+                    *link=-1;
+                }
+                break;
+            }
+            check_claim(&k,*link,1);
+            k.queue[k.tail++]=*link;
+        }
+        while(k.head<k.tail)
+            check_dir(&k,k.queue[k.head++]);
+//blocks which are allocated but not reached are leaked; they are freed a run at a time
+        for(int b=0,start=-1;b<=block_count;b++)
+        {
+            bool leak=b<block_count&&!(free_map[b>>6]>>(b&63)&1)&&!(k.seen[b>>6]>>(b&63)&1);
+            if(leak&&-1==start)
+                start=b;
+            else if(!leak&&-1!=start)
+            {
+                check_report(&k,repair,"blocks %d-%d are allocated but not reachable",start,~-b);
+                if(repair)
+                    mark_blocks(start,b-start,true);
+                start=-1;
+            }
+        }
+        int free_count=0;
+        for(int w=0;w<map_words;w++)
+            free_count+=__builtin_popcountll(free_map[w]&(w<~-map_words||!(block_count&63)?~0ULL:(1ULL<<(block_count&63))-1));
+        if(free_count!=sblock->free_count)
+        {
+            check_report(&k,repair,"free count is %d but %d blocks are free",sblock->free_count,free_count);
+            if(repair)
+            {
+                touch(&sblock->free_count,sizeof(int));
+                sblock->free_count=free_count;
+            }
+        }
+        if(0>sblock->next_fit||block_count<=sblock->next_fit)
+        {
+            check_report(&k,repair,"next fit %d is not a block",sblock->next_fit);
+            if(repair)
+            {
+                touch(&sblock->next_fit,sizeof(int));
+                sblock->next_fit=0;
+            }
+        }
+    }
+//in-memory state is rebuilt from the repaired disk
+    if(ok&&k.fixed)
+    {
+        build_index();
+        dc_init();
+        fmap.file=ra_file=-1;
+        ok=path_set(k.seen[sess->working>>6]>>(sess->working&63)&1?sess->working:root);
+    }
+    if(NULL==k.seen||NULL==k.queue)
+        fprintf(sess->out,"\tfsck: out of memory\n");
+    else
+        fprintf(sess->out,"\t%d folders, %d files, %d problems, %d repaired\n",k.folders,k.files,k.problems,k.fixed);
+    free(k.seen);
+    free(k.queue);
+    free(k.bad);
+    return ok&&k.problems==k.fixed;
+}
+
+//bad items are dropped after the walk, last first, so that every item moved into a freed slot is already checked
+void check_dir(struct check *k,int f)
+{
+    struct folder *dir=get_folder(f);
+    k->folders++;
+    int n=0>dir->item_count?0:dir->item_count;
+    int need=head_items<n?(n-head_items+block_items-1)/block_items:0,j=0,last=-1;
+//item blocks up to the first one which is not linked back to the one before it
+    for(int b=dir->first_block;j<need&&check_node(k,b,BLK_ITEM)&&last==get_item_block(b)->prev;last=b,b=get_item_block(b)->next,j++)
+        check_claim(k,b,1);
+    if(j<need)
+        n=head_items+j*block_items;
+    if(n!=dir->item_count||last!=dir->last_block||(-1==last?-1!=dir->first_block:-1!=get_item_block(last)->next))
+    {
+        check_report(k,k->repair,"folder %.*s (block %d) has %d items in a chain of %d blocks",name_length,get_name(f),f,dir->item_count,j);
+        if(k->repair)
+        {
+            touch(dir,sizeof(struct folder));
+            dir->item_count=n;
+            dir->last_block=last;
+            if(-1==last)
+                dir->first_block=-1;
+            else
+            {
+                touch(get_item_block(last),sizeof(struct item_block));
+                get_item_block(last)->next=-1;
+            }
+        }
+    }
+    k->bad_n=0;
+    for(int i=0,b=-1;i<n;i++)
+    {
+        struct dir_entry *item=walk_item(dir,i,&b);
+        int eb=i<head_items?f:b,es=i<head_items?i:(i-head_items)%block_items,c=item->inode;
+//an item is dangling if its block is not a live file or folder or is reached through another item
+        if(!check_node(k,c,item->type?BLK_FOLDER:BLK_FILE))
+        {
+            check_report(k,k->repair,"item %.*s of folder %.*s points to block %d",name_length,item->name,name_length,get_name(f),c);
+            if(k->repair&&k->bad_n==k->bad_cap)
+            {
+                int *bad=realloc(k->bad,(k->bad_cap=k->bad_cap?k->bad_cap<<1:64)*2*sizeof(int));
+                if(NULL==bad)
+                {
+                    k->fixed--;
+                    continue;
+                }
+                k->bad=bad;
+            }
+            if(k->repair)
+            {
+                k->bad[2*k->bad_n]=eb;
+                k->bad[2*k->bad_n++ +1]=es;
+            }
+            continue;
+        }
+        check_claim(k,c,1);
+//names are kept in the superblock and in the item; the superblock is taken as right
+        if(strncmp(item->name,get_name(c),name_length))
+        {
+            check_report(k,k->repair,"item %.*s of block %d is named %.*s",name_length,item->name,c,name_length,get_name(c));
+            if(k->repair)
+            {
+                touch(item->name,name_length);
+                memcpy(item->name,get_name(c),name_length);
+                item->name[~-name_length]=0;
+            }
+        }
+        int *parent=item->type?&get_folder(c)->parent:&get_file(c)->dir;
+        int *block=item->type?&get_folder(c)->entry_block:&get_file(c)->entry_block;
+        int *slot=item->type?&get_folder(c)->entry_slot:&get_file(c)->entry_slot;
+        if(f!=*parent||eb!=*block||es!=*slot)
+        {
+            check_report(k,k->repair,"item %.*s of folder %.*s is not linked back to it",name_length,item->name,name_length,get_name(f));
+            if(k->repair)
+            {
+                touch(parent,sizeof(int));
+                *parent=f;
+                set_entry(c,eb,es);
+            }
+        }
+        if(item->type)
+            k->queue[k->tail++]=c;
+        else
+            check_file(k,c);
+    }
+    for(int i=~-k->bad_n;~i;i--)
+        drop_entry(f,k->bad[2*i],k->bad[2*i+1]);
+}
+
+//extent blocks are claimed only after the extents are checked, since those past the valid extents are given up
+void check_file(struct check *k,int c)
+{
+    struct file *fp=get_file(c);
+    k->files++;
+    int n=0>fp->extent_count?0:fp->extent_count;
+    int need=head_extents<n?(n-head_extents+block_extents-1)/block_extents:0,j=0,tail=-1;
+    for(int b=fp->first_block;j<need&&check_node(k,b,BLK_EXTENT)&&tail==get_extent_block(b)->prev;tail=b,b=get_extent_block(b)->next)
+        j++;
+    bool broken=j<need||tail!=fp->last_block||(-1==tail?-1!=fp->first_block:-1!=get_extent_block(tail)->next);
+    if(broken)
+        check_report(k,k->repair,"file %.*s (block %d) has %d extents in a chain of %d blocks",name_length,get_name(c),c,fp->extent_count,j);
+    if(j<need)
+        n=head_extents+j*block_extents;
+    if(0>fp->size||0>fp->extent_count)
+    {
+        check_report(k,k->repair,"file %.*s has size %d and %d extents",name_length,get_name(c),fp->size,fp->extent_count);
+        if(k->repair)
+        {
+            touch(fp,sizeof(struct file));
+            fp->size=0>fp->size?0:fp->size;
+            fp->extent_count=n;
+        }
+    }
+//data extents up to the first bad one; when repairing, blocks past the size of the file are given up too
+    long long want=0>fp->size?0:(fp->size+block_size-1LL)/block_size;
+    int m=0,total=0,found=0;
+    for(int i=0,b=-1;i<n;i++)
+    {
+        struct extent *ext=walk_extent(fp,i,&b);
+        if(!check_run(k,ext->start,ext->length,BLK_DATA))
+        {
+            check_report(k,k->repair,"extent %d of file %.*s covers blocks which are not its own",i,name_length,get_name(c));
+            break;
+        }
+        int len=k->repair&&total+ext->length>want?(int)(want-total):ext->length;
+        found+=ext->length;
+        if(!len)
+            continue;
+        if(len<ext->length)
+        {
+            touch(ext,sizeof(struct extent));
+            ext->length=len;
+        }
+        check_claim(k,ext->start,len);
+        total+=len;
+        m=-~i;
+    }
+    int keep=head_extents<m?(m-head_extents+block_extents-1)/block_extents:0,last=-1;
+    if(!k->repair)
+        keep=j;
+    for(int b=fp->first_block,i=0;i<keep;last=b,b=get_extent_block(b)->next,i++)
+        check_claim(k,b,1);
+    if(found!=fp->block_count)
+        check_report(k,k->repair,"file %.*s has block count %d but %d data blocks",name_length,get_name(c),fp->block_count,found);
+    if(found>want)
+        check_report(k,k->repair,"file %.*s of size %d has %d data blocks",name_length,get_name(c),fp->size,found);
+    if(total<want)
+        check_report(k,k->repair,"file %.*s of size %d has only %d data blocks",name_length,get_name(c),fp->size,total);
+    if(!k->repair||(!broken&&m==fp->extent_count&&last==fp->last_block&&total==fp->block_count&&total>=want))
+        return;
+    touch(fp,sizeof(struct file));
+    fp->extent_count=m;
+    fp->block_count=total;
+    if(total<want)
+        fp->size=total*block_size;
+    fp->last_block=last;
+    if(-1==last)
+        fp->first_block=-1;
+    else
+    {
+        touch(get_extent_block(last),sizeof(struct extent_block));
+        get_extent_block(last)->next=-1;
+    }
+}
+
+//a block in range is checked against the superblock and the blocks reached so far
+bool check_run(struct check *k,int start,int n,int kind)
+{
+    if(0>start||0>=n||block_count-start<n)
+        return false;
+    for(int b=start;b<start+n;b++)
+        if(k->seen[b>>6]>>(b&63)&1||(kind!=block_type[b]&&!(BLK_DATA==kind&&BLK_FRESH==block_type[b])))
+            return false;
+    return true;
+}
+
+//a file, folder or chain block must be allocated as well; data blocks marked free are only allocated again
+bool check_node(struct check *k,int b,int kind)
+{
+    return check_run(k,b,1,kind)&&!(free_map[b>>6]>>(b&63)&1);
+}
+
+void check_claim(struct check *k,int start,int n)
+{
+    struct super_block *sblock=get_sblock();
+    int lost=0;
+    for(int b=start;b<start+n;b++)
+    {
+        k->seen[b>>6]|=1ULL<<(b&63);
+        if(!(free_map[b>>6]>>(b&63)&1))
+            continue;
+        lost++;
+        if(k->repair)
+        {
+            touch(&free_map[b>>6],sizeof(free_map[0]));
+            touch(&sblock->free_count,sizeof(int));
+            free_map[b>>6]&=~(1ULL<<(b&63));
+            sblock->free_count--;
+        }
+    }
+    if(lost)
+        check_report(k,k->repair,"%d of blocks %d-%d are in use but marked free",lost,start,start+n-1);
+}
+
+//only the first FSCK_REPORT problems are printed
+void check_report(struct check *k,bool fixed,char *fmt,...)
+{
+    k->problems++;
+    k->fixed+=fixed;
+    if(FSCK_REPORT<k->problems)
+        return;
+    va_list ap;
+    va_start(ap,fmt);
+    fprintf(sess->out,"\tfsck: ");
+    vfprintf(sess->out,fmt,ap);
+    fprintf(sess->out,fixed?" (repaired)\n":"\n");
+    va_end(ap);
+}
+
+//superblock starts at the beginning of the disk
+struct super_block *get_sblock()
+{
+    return (struct super_block *)disk;
+}
+
+//names follow the kinds of blocks in the superblock
+char *get_name(int i)
+{
+    return block_name+(size_t)i*name_length;
+}
+
+//appends to the last extent when the new blocks follow it
+bool add_extent(struct file *fp,int start,int n)
+{
+    struct extent *ext=fp->extent_count?tail_extent(fp):NULL;
+    touch(fp,sizeof(struct file));
+    if(NULL!=ext&&start==ext->start+ext->length)
+    {
+        touch(ext,sizeof(struct extent));
+        ext->length+=n;
+        fp->block_count+=n;
+        return true;
+    }
+//first extent of an extent block needs a new block at the end of the chain
+    int i=fp->extent_count-head_extents;
+    if(0<=i&&!(i%block_extents))
+    {
+        int k=alloc_block("",-1,BLK_EXTENT);
+        if(-1==k)
+        {
+//blocks which cannot be recorded are given back
+            mark_blocks(start,n,true);
+            return false;
+        }
+        touch(get_extent_block(k),sizeof(struct extent_block));
+        get_extent_block(k)->prev=fp->last_block;
+        get_extent_block(k)->next=-1;
+        if(-1==fp->last_block)
+            fp->first_block=k;
+        else
+        {
+            touch(get_extent_block(fp->last_block),sizeof(struct extent_block));
+            get_extent_block(fp->last_block)->next=k;
+        }
+        fp->last_block=k;
+    }
+    fp->extent_count++;
+    ext=tail_extent(fp);
+    touch(ext,sizeof(struct extent));
+    ext->start=start;
+    ext->length=n;
+    fp->block_count+=n;
+    return true;
+}
+
+//extents after the first head_extents are packed in the chain of extent blocks in order
+struct extent *tail_extent(struct file *fp)
+{
+    int i=~-(fp->extent_count);
+    if(i<head_extents)
+        return &fp->extent[i];
+    return &get_extent_block(fp->last_block)->extent[(i-head_extents)%block_extents];
+}
+
+struct extent *walk_extent(struct file *fp,int i,int *block)
+{
+    if(i<head_extents)
+        return &fp->extent[i];
+    i-=head_extents;
+//step to next extent block at the start of each block
+    if(!(i%block_extents))
+        *block=(i?get_extent_block(*block)->next:fp->first_block);
+    return &get_extent_block(*block)->extent[i%block_extents];
+}
+
+//continues from the last looked up extent if the block is not before it
+void fmap_forget()
+{
+    pthread_mutex_lock(&bc_mx);
+    fmap.file=ra_file=-1;
+    pthread_mutex_unlock(&bc_mx);
+}
+
+int file_block(int c,int k)
+{
+    struct file *fp=get_file(c);
+    if(0>k||k>=fp->block_count)
+        return -1;
+    if(c!=fmap.file)
+    {
+        fmap.file=c;
+        fmap.chain_count=-1;
+        fmap_seek(fp,0);
+    }
+    else if(k<fmap.base)
+        fmap_seek(fp,k);
+    while(k>=fmap.base+fmap.ext->length)
+    {
+        fmap.base+=fmap.ext->length;
+        fmap.ext=walk_extent(fp,++fmap.i,&fmap.b);
+    }
+    return fmap.ext->start+k-fmap.base;
+}
+
+//going back searches the listed extent blocks, so that at most one extent block of extents is walked again
+void fmap_seek(struct file *fp,int k)
+{
+    int lo=0,hi=-1;
+    if(fp->extent_count>head_extents&&(-1!=fmap.chain_count||fmap_chain(fp))&&k>=fmap.chain_base[0])
+        for(hi=~-fmap.chain_count;lo<hi;)
+        {
+            int mid=(lo+hi+1)/2;
+            if(k<fmap.chain_base[mid])
+                hi=~-mid;
+            else
+                lo=mid;
+        }
+    if(-1==hi)
+    {
+        fmap.i=fmap.base=0;
+        fmap.b=-1;
+        fmap.ext=walk_extent(fp,0,&fmap.b);
+        return;
+    }
+    fmap.i=head_extents+lo*block_extents;
+    fmap.b=fmap.chain[lo];
+    fmap.base=fmap.chain_base[lo];
+    fmap.ext=&get_extent_block(fmap.b)->extent[0];
+}
+
+//walks every extent once; the list is kept until the file is no longer mapped
+bool fmap_chain(struct file *fp)
+{
+    int n=(fp->extent_count-head_extents+block_extents-1)/block_extents;
+    if(n>fmap.chain_cap)
+    {
+        int *chain=realloc(fmap.chain,n*sizeof(int)),*base;
+        if(NULL!=chain)
+            fmap.chain=chain;
+        if(NULL==chain||NULL==(base=realloc(fmap.chain_base,n*sizeof(int))))
+            return false;
+        fmap.chain_base=base;
+        fmap.chain_cap=n;
+    }
+    fmap.chain_count=0;
+    for(int i=0,b=-1,base=0;i<fp->extent_count;i++)
+    {
+        struct extent *ext=walk_extent(fp,i,&b);
+        if(i>=head_extents&&!((i-head_extents)%block_extents))
+        {
+            fmap.chain[fmap.chain_count]=b;
+            fmap.chain_base[fmap.chain_count++]=base;
+        }
+        base+=ext->length;
+    }
+    return true;
+}
+
+//folders are stored at the beginning of their block
+struct folder *get_folder(int i)
+{
+    return (struct folder *)(disk+(size_t)i*block_size);
+}
+
+//files are stored at the beginning of their block
+struct file *get_file(int i)
+{
+    return (struct file *)(disk+(size_t)i*block_size);
+}
+
+//item blocks are stored at the beginning of their block
+struct item_block *get_item_block(int i)
+{
+    return (struct item_block *)(disk+(size_t)i*block_size);
+}
+
+//extent blocks are stored at the beginning of their block
+struct extent_block *get_extent_block(int i)
+{
+    return (struct extent_block *)(disk+(size_t)i*block_size);
+}
+
+//items after the first head_items are packed in the chain of item blocks in order
+struct dir_entry *walk_item(struct folder *dir,int i,int *block)
+{
+    if(i<head_items)
+        return (struct dir_entry *)(dir->item+i*entry_size);
+    i-=head_items;
+//step to next item block at the start of each block
+    if(!(i%block_items))
+        *block=(i?get_item_block(*block)->next:dir->first_block);
+    return (struct dir_entry *)(get_item_block(*block)->item+i%block_items*entry_size);
+}
+
+//slots of a folder block follow its header; slots of an item block follow the chain links
+struct dir_entry *entry_at(int block,int slot)
+{
+    if(BLK_FOLDER==block_type[block])
+        return (struct dir_entry *)(get_folder(block)->item+slot*entry_size);
+    return (struct dir_entry *)(get_item_block(block)->item+slot*entry_size);
+}
+
+//every file and folder remembers where its item is, so that it can be removed without a scan
+void set_entry(int i,int block,int slot)
+{
+    touch(get_folder(i),BLK_FOLDER==block_type[i]?sizeof(struct folder):sizeof(struct file));
+    if(BLK_FOLDER==block_type[i])
+    {
+        get_folder(i)->entry_block=block;
+        get_folder(i)->entry_slot=slot;
+    }
+    else
+    {
+        get_file(i)->entry_block=block;
+        get_file(i)->entry_slot=slot;
+    }
+}
+
+//FNV-1a hash over type, parent and name; length of name comes for free
+unsigned hash_key(char *name,int parent,bool type,int *len)
+{
+    unsigned hash=2166136261u^type;
+    for(int i=0;i<4;i++,parent>>=8)
+        hash=(hash^(parent&255))*16777619u;
+    char *p=name;
+    for(;*p;p++)
+        hash=(hash^(unsigned char)*p)*16777619u;
+    *len=p-name;
+    return hash;
+}
+
+//adds a block to the block index
+void index_add(int i,char *name,int parent,bool type)
+{
+    struct index_node *node=&idx_node[i];
+    pthread_rwlock_wrlock(&index_rw);
+    node->parent=parent;
+    node->type=type;
+    node->used=true;
+    node->hash=hash_key(name,parent,type,&node->len);
+//push at the front of its bucket
+    node->next=idx_head[node->hash%block_count];
+    idx_head[node->hash%block_count]=i;
+    pthread_rwlock_unlock(&index_rw);
+}
+
+//removes a block from the block index
+void index_del(int i)
+{
+    pthread_rwlock_wrlock(&index_rw);
+    if(idx_node[i].used)
+    {
+        idx_node[i].used=false;
+//unlink from its bucket chain
+        int *p=&idx_head[idx_node[i].hash%block_count];
+        while(i!=*p)
+            p=&idx_node[*p].next;
+        *p=idx_node[i].next;
+    }
+    pthread_rwlock_unlock(&index_rw);
+}
+
+//rebuilds block index from the disk (used when disk is initialized or mounted)
+bool build_index()
+{
+    for(int i=~-block_count;~i;i--)
+        idx_head[i]=-1;
+    for(int i=~-block_count;~i;i--)
+        idx_node[i].used=false;
+    for(int i=0;i<block_count;i++)
+    {
+        if(free_map[i>>6]>>(i&63)&1)
+            continue;
+        if(BLK_FOLDER==block_type[i]&&-1!=get_folder(i)->parent)
+            index_add(i,get_name(i),get_folder(i)->parent,true);
+        else if(BLK_FILE==block_type[i])
+            index_add(i,get_name(i),get_file(i)->dir,false);
+    }
+    return true;
+}
+
+//probes the cache first; on a miss asks the block index and remembers the answer, even if it is absent
+int lookup(int dir,char *name,bool type)
+{
+    pthread_mutex_lock(&dc_mx);
+    int e=dc_find(dir,name,type),i;
+    if(-1!=e)
+    {
+        dc_hits++;
+        dc_touch(e);
+        i=dcache[e].inode;
+        pthread_mutex_unlock(&dc_mx);
+        return i;
+    }
+    dc_misses++;
+    i=find_block(name,dir,type);
+//names which do not fit in an entry are not cached
+    if((size_t)name_length<=strlen(name))
+    {
+        pthread_mutex_unlock(&dc_mx);
+        return i;
+    }
+//reuse least recently used entry
+    e=dcache[dc_mru].lru_prev;
+    if(dcache[e].used)
+        dc_drop(e);
+    struct dentry *entry=&dcache[e];
+    strcpy(entry->name,name);
+    entry->parent=dir;
+    entry->type=type;
+    entry->inode=i;
+    entry->used=true;
+    entry->hash=hash_key(entry->name,dir,type,&entry->len);
+    entry->next=dc_head[entry->hash%DCACHE_SIZE];
+    dc_head[entry->hash%DCACHE_SIZE]=e;
+    dc_touch(e);
+    pthread_mutex_unlock(&dc_mx);
+    return i;
+}
+
+//a lookup which finds nothing must not race with an item being added, so the directory is held meanwhile
+int lookup_locked(int dir,char *name,bool type)
+{
+    pthread_rwlock_rdlock(&dir_rw[dir%DIR_LOCKS]);
+    int i=lookup(dir,name,type);
+    pthread_rwlock_unlock(&dir_rw[dir%DIR_LOCKS]);
+    return i;
+}
+
+//all entries start unused in one circular LRU list
+void dc_init()
+{
+    for(int i=0;i<DCACHE_SIZE;i++)
+    {
+        dc_head[i]=-1;
+        dcache[i].used=false;
+        dcache[i].lru_prev=(i+DCACHE_SIZE-1)%DCACHE_SIZE;
+        dcache[i].lru_next=-~i%DCACHE_SIZE;
+    }
+    dc_mru=0;
+    dc_hits=dc_misses=0;
+}
+
+//walks one bucket
+int dc_find(int dir,char *name,bool type)
+{
+    int len;
+    unsigned hash=hash_key(name,dir,type,&len);
+    for(int e=dc_head[hash%DCACHE_SIZE];~e;e=dcache[e].next)
+        if(hash==dcache[e].hash&&len==dcache[e].len&&dir==dcache[e].parent&&type==dcache[e].type&&!memcmp(dcache[e].name,name,len))
+            return e;
+    return -1;
+}
+
+void dc_forget(int dir,char *name,bool type)
+{
+    pthread_mutex_lock(&dc_mx);
+    int e=dc_find(dir,name,type);
+    if(-1!=e)
+        dc_drop(e);
+    pthread_mutex_unlock(&dc_mx);
+}
+
+//unlinks the entry from its bucket and makes it the first one to be reused
+void dc_drop(int e)
+{
+    int *p=&dc_head[dcache[e].hash%DCACHE_SIZE];
+    while(e!=*p)
+        p=&dcache[*p].next;
+    *p=dcache[e].next;
+    dcache[e].used=false;
+//least recently used position is just before the most recently used one
+    dc_touch(e);
+    dc_mru=dcache[e].lru_next;
+}
+
+//moves the entry to the front of the circular LRU list
+void dc_touch(int e)
+{
+    if(e==dc_mru)
+        return;
+    struct dentry *entry=&dcache[e];
+    dcache[entry->lru_prev].lru_next=entry->lru_next;
+    dcache[entry->lru_next].lru_prev=entry->lru_prev;
+    entry->lru_next=dc_mru;
+    entry->lru_prev=dcache[dc_mru].lru_prev;
+    dcache[entry->lru_prev].lru_next=e;
+    dcache[dc_mru].lru_prev=e;
+    dc_mru=e;
+}
+
+//every change to disk goes through here first, so that the block can be logged at the next commit and copied for
+//the snapshots before it changes
+void touch(void *p,size_t n)
+{
+    count(&touch_bytes,n);
+    if((-1==journal_fd&&NULL==snapshots)||!n)
+        return;
+    pthread_mutex_lock(&journal_mx);
+    for(long b=((char *)p-disk)/block_size,end=((char *)p-disk+n-1)/block_size;b<=end;b++)
+    {
+        if(NULL!=snapshots&&snap_mod[b]<snap_epoch)
+            snap_save(b);
+        if(-1!=journal_fd&&!(dirty_map[b>>6]>>(b&63)&1))
+        {
+            dirty_map[b>>6]|=1ULL<<(b&63);
+            dirty_list[dirty_count++]=b;
+        }
+    }
+    pthread_mutex_unlock(&journal_mx);
+}
+
+//group commit: durability of a command is deferred until group_size commands have ended; a transaction holds
+//whole commands only, so the commit waits until no command is running
+void journal_end()
+{
+    if(-1==journal_fd||__atomic_add_fetch(&group_pending,1,__ATOMIC_RELAXED)<group_size)
+        return;
+    bool held=disk_lock(CMD_ALONE,NULL);
+    if(__atomic_load_n(&group_pending,__ATOMIC_RELAXED)>=group_size)
+        journal_flush();
+    if(held)
+        disk_unlock(CMD_ALONE,-1);
+}
+
+//a transaction is written as header, blocks and commit record; the image is written only after the journal is on disk
+bool journal_flush()
+{
+    if(-1==journal_fd)
+        return true;
+    bc_flush();
+    __atomic_store_n(&group_pending,0,__ATOMIC_RELAXED);
+    if(!dirty_count)
+        return true;
+    struct journal_head head={JOURNAL_MAGIC,journal_seq++,dirty_count,block_size,0};
+    for(int i=0;i<dirty_count;i++)
+        head.sum+=journal_sum(dirty_list[i],disk+(size_t)dirty_list[i]*block_size,block_size);
+    char *buf=journal_buf;
+    off_t at=journal_size;
+    bool ok=sizeof(head)==pwrite(journal_fd,&head,sizeof(head),at);
+    at+=sizeof(head);
+    for(int i=0;ok&&i<dirty_count;i+=JOURNAL_CHUNK)
+    {
+        char *p=buf;
+        for(int j=i;j<dirty_count&&j<i+JOURNAL_CHUNK;j++)
+        {
+            memcpy(p,&dirty_list[j],sizeof(int));
+            memcpy(p+sizeof(int),disk+(size_t)dirty_list[j]*block_size,block_size);
+            count(&copy_bytes,block_size);
+            p+=sizeof(int)+block_size;
+        }
+        ok=p-buf==pwrite(journal_fd,buf,p-buf,at);
+        at+=p-buf;
+    }
+    head.magic=COMMIT_MAGIC;
+    ok=ok&&sizeof(head)==pwrite(journal_fd,&head,sizeof(head),at)&&!fdatasync(journal_fd);
+    if(!ok)
+    {
+        fprintf(sess->out,"\tjournal: commit failed\n");
+        return false;
+    }
+    journal_size=at+sizeof(head);
+    journal_commits++;
+    journal_blocks+=dirty_count;
+//committed; write blocks in place and forget them. A block which could not be written stays changed, so that it is
+//committed and written again next time, and the journal which holds it is not emptied meanwhile
+    int left=0;
+    for(int i=0;i<dirty_count;i++)
+    {
+        int b=dirty_list[i];
+        if(block_size==pwrite(disk_fd,disk+(size_t)b*block_size,block_size,(off_t)b*block_size))
+            dirty_map[b>>6]&=~(1ULL<<(b&63));
+        else
+            dirty_list[left++]=b;
+    }
+    dirty_count=left;
+    if(left)
+    {
+        fprintf(sess->out,"\tjournal: %d blocks could not be written to the image\n",left);
+        return false;
+    }
+//checkpoint: once the image is on disk the journal is not needed any more
+    if(JOURNAL_LIMIT<journal_size&&!fdatasync(disk_fd)&&!ftruncate(journal_fd,0))
+        journal_size=0;
+    return true;
+}
+
+//transactions are applied in order up to the first one which is torn or corrupt; the geometry of the image is not
+//known before the journal is replayed, so every transaction records the size of its blocks
+bool journal_replay(int image,int journal)
+{
+    struct journal_head head,commit;
+    struct stat st;
+    char *buf=NULL;
+    off_t at=0;
+    int n=0;
+    if(-1==fstat(image,&st))
+        return false;
+    while(sizeof(head)==pread(journal,&head,sizeof(head),at)&&JOURNAL_MAGIC==head.magic&&0<=head.count
+        &&0<head.block_size&&head.block_size<=st.st_size)
+    {
+        size_t size=sizeof(int)+head.block_size;
+        char *grown=realloc(buf,size);
+        if(NULL==grown)
+            break;
+        buf=grown;
+        off_t body=at+sizeof(head),end=body+(off_t)head.count*size;
+        unsigned sum=0;
+        bool ok=sizeof(commit)==pread(journal,&commit,sizeof(commit),end)&&COMMIT_MAGIC==commit.magic&&head.seq==commit.seq;
+        for(int i=0;ok&&i<head.count;i++)
+        {
+            int b;
+            ok=(ssize_t)size==pread(journal,buf,size,body+(off_t)i*size);
+            memcpy(&b,buf,sizeof(int));
+            ok=ok&&0<=b&&b<st.st_size/head.block_size;
+            if(ok)
+                sum+=journal_sum(b,buf+sizeof(int),head.block_size);
+        }
+        if(!ok||sum!=head.sum)
+            break;
+        for(int i=0;ok&&i<head.count;i++)
+        {
+            int b;
+            ok=(ssize_t)size==pread(journal,buf,size,body+(off_t)i*size);
+            memcpy(&b,buf,sizeof(int));
+            ok=ok&&head.block_size==pwrite(image,buf+sizeof(int),head.block_size,(off_t)b*head.block_size);
+        }
+        if(!ok)
+        {
+            free(buf);
+            return false;
+        }
+        n++;
+        journal_seq=head.seq+1;
+        at=end+sizeof(commit);
+    }
+    free(buf);
+    if(n)
+        fprintf(sess->out,"\tjournal: %d transactions replayed\n",n);
+    return !fdatasync(image)&&!ftruncate(journal,0);
+}
+
+//FNV-1a over block number and contents
+unsigned journal_sum(int b,char *data,int n)
+{
+    unsigned sum=2166136261u;
+    for(int i=0;i<4;i++,b>>=8)
+        sum=(sum^(b&255))*16777619u;
+    for(int i=0;i<n;i++)
+        sum=(sum^(unsigned char)data[i])*16777619u;
+    return sum;
+}
+
+//snapshots still kept which were taken since the block was copied last share the copy
+void snap_save(int b)
+{
+    int refs=0;
+    for(struct snapshot *s=snapshots;NULL!=s&&s->epoch>snap_mod[b];s=s->next)
+        refs++;
+    snap_mod[b]=snap_epoch;
+    if(!refs)
+        return;
+    struct version *v=malloc(sizeof(struct version)+block_size);
+    if(NULL==v)
+    {
+        snap_lost=true;
+        return;
+    }
+    v->epoch=snap_epoch;
+    v->refs=refs;
+    memcpy(v->data,disk+(size_t)b*block_size,block_size);
+    count(&copy_bytes,block_size);
+    if(NULL==snap_ver[b])
+        snap_list[snap_count++]=b;
+    v->next=snap_ver[b];
+    snap_ver[b]=v;
+    snap_blocks++;
+}
+
+//the oldest copy made after the snapshot holds the block as it was then
+struct version *snap_find(int b,int epoch)
+{
+    struct version *v=snap_ver[b];
+    if(NULL==v||v->epoch<epoch)
+        return NULL;
+    while(NULL!=v->next&&v->next->epoch>=epoch)
+        v=v->next;
+    return v;
+}
+
+//taking a snapshot only writes back the buffer cache, so that disk holds everything; the tables of copies are
+//allocated with the first snapshot and freed with the last one
+bool snap_take(char *name)
+{
+    bc_flush();
+    if(NULL==snapshots&&(NULL==(snap_mod=calloc(block_count,sizeof(int)))||NULL==(snap_ver=calloc(block_count,sizeof(struct version *)))
+        ||NULL==(snap_list=malloc(block_count*sizeof(int)))))
+    {
+        free(snap_mod);
+        free(snap_ver);
+        snap_mod=NULL;
+        snap_ver=NULL;
+        return false;
+    }
+    struct snapshot *s=malloc(sizeof(struct snapshot));
+    if(NULL==s||NULL==(s->name=strdup(name)))
+    {
+        free(s);
+        return false;
+    }
+    s->epoch=++snap_epoch;
+    s->next=snapshots;
+    snapshots=s;
+    return true;
+}
+
+void snap_drop(struct snapshot *s)
+{
+    int n=0;
+    for(int k=0;k<snap_count;k++)
+    {
+        int b=snap_list[k];
+        struct version **p=&snap_ver[b];
+        while(NULL!=*p&&NULL!=(*p)->next&&(*p)->next->epoch>=s->epoch)
+            p=&(*p)->next;
+        struct version *v=*p;
+        if(NULL!=v&&v->epoch>=s->epoch&&!--v->refs)
+        {
+            *p=v->next;
+            free(v);
+            snap_blocks--;
+        }
+//blocks left without copies leave the list
+        if(NULL!=snap_ver[b])
+            snap_list[n++]=b;
+    }
+    snap_count=n;
+    struct snapshot **p=&snapshots;
+    while(s!=*p)
+        p=&(*p)->next;
+    *p=s->next;
+    free(s->name);
+    free(s);
+    if(NULL!=snapshots)
+        return;
+    free(snap_mod);
+    free(snap_ver);
+    free(snap_list);
+    snap_mod=NULL;
+    snap_ver=NULL;
+    snap_list=NULL;
+    snap_lost=false;
+}
+
+//only blocks with copies can differ from the snapshot; each of them is copied for the other snapshots first by touch,
+//so those stay restorable. Buffers hold changes made after the snapshot as well and are dropped without writing back
+int snap_restore(struct snapshot *s)
+{
+    int n=0;
+    bc_forget(0,block_count);
+    for(int k=0;k<snap_count;k++)
+    {
+        int b=snap_list[k];
+        struct version *v=snap_find(b,s->epoch);
+        if(NULL==v)
+            continue;
+        touch(disk+(size_t)b*block_size,block_size);
+        memcpy(disk+(size_t)b*block_size,v->data,block_size);
+        count(&copy_bytes,block_size);
+        n++;
+    }
+//in-memory state is rebuilt from the restored disk; sessions in directories it does not have go back to root
+    build_index();
+    dc_init();
+    fmap.file=ra_file=-1;
+    pthread_mutex_lock(&session_mx);
+    for(struct session *p=sessions;NULL!=p;p=p->next)
+        if(!dir_valid(p->working))
+            p->working=get_sblock()->root;
+    pthread_mutex_unlock(&session_mx);
+    path_set(sess->working);
+    return n;
+}
+
+bool dir_valid(int d)
+{
+    for(int n=0;n<block_count;n++)
+    {
+        if(0>d||block_count<=d||free_map[d>>6]>>(d&63)&1||BLK_FOLDER!=block_type[d])
+            return false;
+        if(-1==get_folder(d)->parent)
+            return d==get_sblock()->root;
+        d=get_folder(d)->parent;
+    }
+    return false;
+}
+
+//all buffers start unused in one circular LRU list
+void bc_init()
+{
+    for(int i=0;i<BCACHE_SIZE;i++)
+    {
+        bc_head[i]=-1;
+        bcache[i].block=-1;
+        bcache[i].dirty=false;
+        bcache[i].lru_prev=(i+BCACHE_SIZE-1)%BCACHE_SIZE;
+        bcache[i].lru_next=-~i%BCACHE_SIZE;
+    }
+    bc_mru=0;
+    bc_hits=bc_misses=0;
+}
+
+//on a miss reuses least recently used buffer, writing it back if it is dirty
+struct buffer *bc_get(int block,bool load)
+{
+    int e=bc_find(block);
+    if(-1!=e)
+    {
+        bc_hits++;
+        bc_touch(e);
+        return &bcache[e];
+    }
+    bc_misses++;
+    e=bcache[bc_mru].lru_prev;
+    struct buffer *buf=&bcache[e];
+    if(-1!=buf->block)
+    {
+        if(buf->dirty)
+            bc_write(e);
+        bc_drop(e);
+    }
+    buf->block=block;
+    buf->dirty=false;
+    buf->next=bc_head[block%BCACHE_SIZE];
+    bc_head[block%BCACHE_SIZE]=e;
+    if(load&&BLK_FRESH==block_type[block])
+        memset(buf->data,0,block_size);
+    else if(load)
+    {
+        memcpy(buf->data,disk+(size_t)block*block_size,block_size);
+        count(&copy_bytes,block_size);
+    }
+    bc_touch(e);
+    return buf;
+}
+
+//walks one bucket
+int bc_find(int block)
+{
+    for(int e=bc_head[block%BCACHE_SIZE];~e;e=bcache[e].next)
+        if(block==bcache[e].block)
+            return e;
+    return -1;
+}
+
+//probes each block of a short range, otherwise checks every buffer
+void bc_forget(int start,int n)
+{
+    if(n<=BCACHE_SIZE)
+    {
+        for(int i=start,e;i<start+n;i++)
+            if(-1!=(e=bc_find(i)))
+                bc_drop(e);
+        return;
+    }
+    for(int e=0;e<BCACHE_SIZE;e++)
+        if(start<=bcache[e].block&&bcache[e].block<start+n)
+            bc_drop(e);
+}
+
+//unlinks the buffer from its bucket and makes it the first one to be reused
+void bc_drop(int e)
+{
+    int *p=&bc_head[bcache[e].block%BCACHE_SIZE];
+    while(e!=*p)
+        p=&bcache[*p].next;
+    *p=bcache[e].next;
+    bcache[e].block=-1;
+    bcache[e].dirty=false;
+    bc_touch(e);
+    bc_mru=bcache[e].lru_next;
+}
+
+//dirty buffers stay cached after being written back
+void bc_flush()
+{
+    for(int e=0;e<BCACHE_SIZE;e++)
+        if(bcache[e].dirty)
+            bc_write(e);
+}
+
+//a new block holds data from now on
+void bc_write(int e)
+{
+    struct buffer *buf=&bcache[e];
+    touch(disk+(size_t)buf->block*block_size,block_size);
+    memcpy(disk+(size_t)buf->block*block_size,buf->data,block_size);
+    count(&copy_bytes,block_size);
+    if(BLK_FRESH==block_type[buf->block])
+    {
+        touch(&block_type[buf->block],1);
+        block_type[buf->block]=BLK_DATA;
+    }
+    buf->dirty=false;
+}
+
+//moves the buffer to the front of the circular LRU list
+void bc_touch(int e)
 {
-//add=true means add the item at the end of item list
-    if(add)
+    if(e==bc_mru)
+        return;
+    struct buffer *buf=&bcache[e];
+    bcache[buf->lru_prev].lru_next=buf->lru_next;
+    bcache[buf->lru_next].lru_prev=buf->lru_prev;
+    buf->lru_next=bc_mru;
+    buf->lru_prev=bcache[bc_mru].lru_prev;
+    bcache[buf->lru_prev].lru_next=e;
+    bcache[bc_mru].lru_prev=e;
+    bc_mru=e;
+}
+
+//monotonic clock for benchmarks
+long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+//grows a fresh subdirectory of current directory and reports cost per item at doubling sizes
+void bench_dir(int n)
+{
+    char name[name_length];
+    if(ch_exist(sess->working,"_bench",true)||!make_dir("_bench",""))
     {
-        struct folder *dir=malloc(BLOCKSIZE);
-        int block_index=find_block(cur_dir,cur_par,true);
-        memcpy(dir,disk+block_index*BLOCKSIZE,BLOCKSIZE);
-        strcpy(dir->item[dir->item_count],name);
-        dir->item_type[dir->item_count]=type;
-        dir->item_count++;
-        memcpy(disk+block_index*BLOCKSIZE,dir,BLOCKSIZE);
-        free(dir);
+        fprintf(sess->out,"\tbench: cannot create directory _bench\n");
+        return;
     }
-//add=false means remove the item
-    else
+//work inside the benchmark directory without touching the shell path
+    int saved=sess->working;
+    sess->working=find_block("_bench",sess->working,true);
+    fprintf(sess->out,"\t%10s %12s %14s\n","items","mkfil(ns)","ch_exist(ns)");
+    int k=0;
+    for(int mark=1000;k<n;mark<<=1)
     {
-        struct folder *dir=malloc(BLOCKSIZE);
-        int block_index=find_block(cur_dir,cur_par,true);
-        memcpy(dir,disk+block_index*BLOCKSIZE,BLOCKSIZE);
-        for(int i=~-(dir->item_count);~i;i--)
+        if(mark>n)
+            mark=n;
+//add items up to the next mark
+        long long t=now_ns();
+        int from=k;
+        for(;k<mark;k++)
         {
-//check for type
-            if(type!=dir->item_type[i])
-                continue;
-//check for name
-            if(!strcmp(name,dir->item[i]))
+            snprintf(name,name_length,"b%d",k);
+            if(!make_file(name,"0"))
+                break;
+        }
+        long long add=(now_ns()-t)/(k>from?k-from:1);
+        if(k==from)
+            break;
+//look up 1000 existing items spread over the directory
+        t=now_ns();
+        int found=0;
+        for(int j=0;j<1000;j++)
+        {
+            snprintf(name,name_length,"b%d",(int)(j*7919LL%k));
+            found+=ch_exist(sess->working,name,false);
+        }
+        fprintf(sess->out,"\t%10d %12lld %14lld\n",k,add,(now_ns()-t)/1000);
+        if(k<mark||1000!=found)
+            break;
+    }
+    if(k<n)
+        fprintf(sess->out,"\tbench: disk full after %d items\n",k);
+//clean up
+    sess->working=saved;
+    rm_dir("_bench","");
+}
+
+//writes and reads a fresh file of current directory in 4 KB pieces, each phase starting with an empty buffer cache
+void bench_io(int kb)
+{
+    char *phase[]={"seq write","seq read","rand write","rand read"};
+    int size=kb*1024,chunk=4096;
+    if(size<chunk||ch_exist(sess->working,"_bench",false)||!make_file("_bench","0"))
+    {
+        fprintf(sess->out,"\tbench: cannot create file _bench of at least 4 KB\n");
+        return;
+    }
+    int c=lookup(sess->working,"_bench",false);
+    char *buf=malloc(chunk);
+    memset(buf,'x',chunk);
+    unsigned seed=1;
+    fprintf(sess->out,"\t%-12s %10s %10s %10s\n","phase","MB/s","hits","misses");
+    for(int p=0;p<4;p++)
+    {
+        bc_flush();
+        bc_init();
+        bool ok=true;
+        long long t=now_ns();
+        for(int off=0;ok&&off<size;off+=chunk)
+        {
+            int at=off,len=size-off<chunk?size-off:chunk;
+//random phases pick any offset which leaves room for a whole piece
+            if(1<p)
             {
-//copy last item at the position of deleting item and decrease item count
-                strcpy(dir->item[i],dir->item[--(dir->item_count)]);
-                dir->item_type[i]=dir->item_type[dir->item_count];
+                seed=seed*1103515245u+12345u;
+                at=(int)((seed>>8)%(unsigned)(size-chunk+1));
+                len=chunk;
             }
+            ok=p&1?len==read_data(c,at,buf,len):write_data(c,at,buf,len);
+        }
+//write-back is part of the cost of writing
+        bc_flush();
+        t=now_ns()-t;
+        if(!ok)
+        {
+            fprintf(sess->out,"\tbench: %s failed (disk full?)\n",phase[p]);
+            break;
         }
-        memcpy(disk+block_index*BLOCKSIZE,dir,BLOCKSIZE);
-        free(dir);
+        fprintf(sess->out,"\t%-12s %10.1f %10lld %10lld\n",phase[p],size/1048576.0/(t>0?t:1)*1e9,bc_hits,bc_misses);
     }
+    free(buf);
+    rm_file("_bench","");
 }
 
-//edits a file size
-bool edit_file(char *name, char *data)
+//creates and removes a file per pair of commands, first committing each command alone and then in groups
+void bench_journal(int n)
 {
-    if(!ch_exist(working.parent,working.name,name,false))
+    if(-1==journal_fd)
     {
-        printf("\tNo such file\n");
-        return true;
+        fprintf(sess->out,"\tbench: journal needs a disk image\n");
+        return;
     }
-    struct file *fp=malloc(BLOCKSIZE);
-    int block_index=find_block(name,working.name,false);
-    memcpy(fp,disk+block_index*BLOCKSIZE,BLOCKSIZE);
-//if size is same then nothing to do
-    if(atoi(data)==fp->size)
+//the file made and removed is the user's own if it exists already
+    if(ch_exist(sess->working,"_bench",false))
     {
-        free(fp);
-        return true;
+        fprintf(sess->out,"\tbench: cannot create file _bench\n");
+        return;
     }
-//temporarily rename the file as "root"
-    r_name(name,"root",false);
-//create a new file
-    if(!make_file(name,data))
+    int saved=group_size;
+    fprintf(sess->out,"\t%8s %12s %10s %10s\n","group","ops/s","commits","blocks");
+    for(int g=1;;g=JOURNAL_GROUP)
     {
-//if failed restore the name of previous file
-        r_name("root",name,false);
-        free(fp);
-        return false;
+        journal_flush();
+        group_size=g;
+        long long commits=journal_commits,blocks=journal_blocks,t=now_ns();
+        for(int i=0;i<n;i++)
+        {
+            make_file("_bench","0");
+            journal_end();
+            rm_file("_bench","");
+            journal_end();
+        }
+        journal_flush();
+        t=now_ns()-t;
+        fprintf(sess->out,"\t%8d %12.0f %10lld %10lld\n",g,2*n/(t/1e9),journal_commits-commits,journal_blocks-blocks);
+        if(JOURNAL_GROUP==g)
+            break;
     }
-//if succeed then delete the temporary file "root"
-    rm_file("root","");
-    free(fp);
-    return true;
+    group_size=saved;
 }
 
-//renames a file
-void r_name(char *old_name,char *new_name,bool type)
+//times the functions behind the commands one after another on n names: directories are made, visited, renamed and moved,
+//files are made, renamed, moved and looked up, blocks are taken and given back, and finally everything is removed
+void bench_ops(int n)
 {
-    struct super_block *sblock=malloc(BLOCKSIZE<<2);
-    memcpy(sblock,disk,(BLOCKSIZE<<2));
-    for(int i=0;i<BLOCK;i++)
-//find block index for the file
-        if(type==sblock->type[i]&&!strcmp(sblock->name[i],old_name))
+    char *op[]={"mkdir","cd","rndir","mvdir","mkfil","rnfil","mvfil","find_block","lookup","alloc_block","rmfil","rmdir"};
+    char name[name_length],other[name_length],*text=NULL;
+    struct line line,*was=sess->cur_line;
+    if(ch_exist(sess->working,"_bench",true)||!make_dir("_bench","")||!path_push(lookup(sess->working,"_bench",true)))
+    {
+        fprintf(sess->out,"\tbench: cannot create directory _bench\n");
+        return;
+    }
+//moves go to _bench\_to given as a whole path, as a command line would give it
+    int to=make_dir("_to","")?lookup(sess->working,"_to",true):-1;
+    if(-1==to||!bench_path("\\_to",&line,&text))
+        fprintf(sess->out,"\tbench: cannot create directory _to\n");
+    else
+    {
+        sess->cur_line=&line;
+        fprintf(sess->out,"\t%-12s %10s %10s %10s\n","operation","ns/op","blocks/op","bytes/op");
+        for(int p=0;p<12;p++)
         {
-            if(type)
+//removals run inside _to where everything was moved
+            if(10==p)
+                path_push(to);
+            long long t=now_ns(),a=alloc_count,b=touch_bytes;
+            bool ok=true;
+            int k=0;
+            for(;ok&&k<n;k++)
             {
-                struct folder *dir=malloc(BLOCKSIZE);
-                memcpy(dir,disk+i*BLOCKSIZE,BLOCKSIZE);
-//check parent
-                if(!strcmp(dir->parent,working.name))
+                snprintf(name,name_length,"%c%d",p<4||11==p?'d':'f',k);
+                snprintf(other,name_length,"%c%d",p<4||11==p?'e':'g',k);
+                switch(p)
                 {
-//update superblock
-                    strcpy(sblock->name[i],new_name);
-//update file
-                    strcpy(dir->name,new_name);
-                    memcpy(disk+i*BLOCKSIZE,dir,BLOCKSIZE);
-                    free(dir);
-                    break;
+                    case 0: ok=make_dir(name,""); break;
+                    case 1: ok=ch_dir(name,"")&&ch_dir("..",""); break;
+                    case 2: case 5: ok=(2==p?move_dir:move_file)(name,other); break;
+                    case 3: case 6: ok=(3==p?move_dir:move_file)(other,line.word[1].s); break;
+                    case 4: ok=make_file(name,"0"); break;
+                    case 7: ok=-1!=find_block(other,to,false); break;
+                    case 8: ok=-1!=lookup(to,other,false); break;
+                    case 9: {int i=alloc_block("",-1,BLK_DATA); ok=-1!=i&&dealloc_block(i);} break;
+                    case 10: ok=rm_file(other,""); break;
+                    case 11: ok=rm_dir(other,""); break;
                 }
             }
-            struct file *fp=malloc(BLOCKSIZE);
-            memcpy(fp,disk+i*BLOCKSIZE,BLOCKSIZE);
-//check parent
-            if(!strcmp(fp->dir_name,working.name))
+            if(!ok)
             {
-//update superblock
-                strcpy(sblock->name[i],new_name);
-//update file
-                strcpy(fp->name,new_name);
-                memcpy(disk+i*BLOCKSIZE,fp,BLOCKSIZE);
-                free(fp);
+                fprintf(sess->out,"\tbench: %s failed after %d names (disk full?)\n",op[p],--k);
                 break;
             }
+            bench_row(op[p],1==p?2*n:n,t,a,b);
+        }
+        sess->cur_line=was;
+        if(sess->working==to)
+            path_pop();
+    }
+    free(text);
+//clean up whatever is left
+    path_pop();
+    rm_dir("_bench","");
+}
+
+//reports cost per operation against three sizes: blocks allocated, items in one directory and directories in a path
+void bench_scale(int n)
+{
+    char name[name_length],label[16],*text=NULL;
+    struct line line,*was=sess->cur_line;
+    if(ch_exist(sess->working,"_bench",true)||!make_dir("_bench","")||!path_push(lookup(sess->working,"_bench",true)))
+    {
+        fprintf(sess->out,"\tbench: cannot create directory _bench\n");
+        return;
+    }
+//fill the disk with one file and time 1000 single block files made and removed at each level
+    fprintf(sess->out,"\t%-12s %10s %10s %10s\n","disk used","ns/op","blocks/op","bytes/op");
+    int c=make_file("_fill","0")?lookup(sess->working,"_fill",false):-1;
+    for(int pct=0;-1!=c&&pct<100;pct+=25)
+    {
+        struct super_block *sblock=get_sblock();
+        long long want=(long long)block_count*pct/100-(block_count-sblock->free_count),size=get_file(c)->size+want*block_size;
+        if(0<want&&(0x7fffffff<size||!resize_file(c,size)))
+            break;
+        long long t=now_ns(),a=alloc_count,b=touch_bytes;
+        int k=0;
+        for(;k<1000&&make_file("_x","1");k++)
+            rm_file("_x","");
+        snprintf(label,sizeof(label),"%d%%",100-(int)(100LL*sblock->free_count/block_count));
+        bench_row(label,k,t,a,b);
+        if(k<1000)
+            break;
+    }
+    if(-1!=c)
+        rm_file("_fill","");
+//grow a directory by factors of ten and time lookups spread over it, bypassing and through the path cache
+    fprintf(sess->out,"\t%-12s %10s %10s %14s\n","items","find_block","lookup","mkfil+rmfil");
+    int d=make_dir("_fan","")?lookup(sess->working,"_fan",true):-1,k=0;
+    for(int mark=10;-1!=d&&k<n;mark*=10)
+    {
+        if(mark>n)
+            mark=n;
+        sess->working=d;
+        for(;k<mark;k++)
+        {
+            snprintf(name,name_length,"f%d",k);
+            if(!make_file(name,"0"))
+                break;
         }
-    for(int i=0;i<BLOCK;i++)
-//find block index for current directory
-        if(sblock->type[i]&&!strcmp(sblock->name[i],working.name))
+        sess->working=sess->path.inode[sess->path.depth-1];
+        if(k<mark)
         {
-            struct folder *dir=malloc(BLOCKSIZE);
-            memcpy(dir,disk+i*BLOCKSIZE,BLOCKSIZE);
-//check parent of the directory
-            if(!strcmp(dir->parent,working.parent))
-            {
-//update item list
-                for(int j=~-(dir->item_count);~j;j--)
-                {
-                    if(type!=dir->item_type[j])
-                        continue;
-                    if(!strcmp(old_name,dir->item[j]))
-                    {
-                        strcpy(dir->item[j],new_name);
-                        memcpy(disk+i*BLOCKSIZE,dir,BLOCKSIZE);
-                        free(dir);
-                        break;
-                    }
-                }
-            }
+            fprintf(sess->out,"\tbench: disk full after %d items\n",k);
+            break;
+        }
+        long long t[4];
+        t[0]=now_ns();
+        for(int j=0;j<1000;j++)
+        {
+            snprintf(name,name_length,"f%d",(int)(j*7919LL%k));
+            find_block(name,d,false);
+        }
+        t[1]=now_ns();
+        for(int j=0;j<1000;j++)
+        {
+            snprintf(name,name_length,"f%d",(int)(j*7919LL%k));
+            lookup(d,name,false);
+        }
+        t[2]=now_ns();
+        sess->working=d;
+        for(int j=0;j<1000;j++)
+        {
+            make_file("_x","0");
+            rm_file("_x","");
+        }
+        sess->working=sess->path.inode[sess->path.depth-1];
+        t[3]=now_ns();
+        fprintf(sess->out,"\t%-12d %10lld %10lld %14lld\n",k,(t[1]-t[0])/1000,(t[2]-t[1])/1000,(t[3]-t[2])/1000);
+    }
+    if(-1!=d)
+        rm_dir("_fan","");
+//nest directories by doubling depth and time changing to the deepest one by its whole path
+    fprintf(sess->out,"\t%-12s %10s %14s\n","depth","cd(ns)","mkfil+rmfil");
+    int base=sess->path.depth,limit=MAX_PARTS-base-2;
+    if(n>limit)
+        fprintf(sess->out,"\tbench: paths are limited to %d names; depth stops at %d\n",MAX_PARTS,limit);
+    for(int mark=1,depth=0;depth<n&&depth<limit;mark<<=1)
+    {
+        bool ok=true;
+        while(ok&&depth<mark&&depth<n&&depth<limit)
+            if((ok=make_dir("_d","")&&path_push(lookup(sess->working,"_d",true))))
+                depth++;
+        if(!ok||!bench_path("",&line,&text))
+        {
+            fprintf(sess->out,"\tbench: cannot nest deeper than %d\n",sess->path.depth-base);
+            free(text);
+            break;
+        }
+        sess->cur_line=&line;
+        long long t[3];
+        t[0]=now_ns();
+        for(int j=0;j<1000;j++)
+            ch_dir(line.word[1].s,"");
+        t[1]=now_ns();
+        for(int j=0;j<1000;j++)
+        {
+            make_file("_x","0");
+            rm_file("_x","");
         }
-    memcpy(disk,sblock,BLOCKSIZE<<2);
-    free(sblock);
+        t[2]=now_ns();
+        sess->cur_line=was;
+        free(text);
+        text=NULL;
+        fprintf(sess->out,"\t%-12d %10lld %14lld\n",depth,(t[1]-t[0])/1000,(t[2]-t[1])/1000);
+    }
+//clean up: removing _bench removes the nested directories with it
+    path_set(sess->path.inode[base-1]);
+    path_pop();
+    rm_dir("_bench","");
 }
 
-//checks existance of a file or folder
-bool ch_exist(char *cur_par,char *cur_name,char *name,bool type)
+//runs every line of a file as the shell would in batch mode and adds up the cost by command; unknown commands are counted together
+void bench_trace(char *file)
 {
-    struct folder *dir=malloc(BLOCKSIZE);
-    int block_index=find_block(cur_name,cur_par,true);
-    memcpy(dir,disk+block_index*BLOCKSIZE,BLOCKSIZE);
-    for(int i=~-(dir->item_count);~i;i--)
+    FILE *in=fopen(file,"r");
+    if(NULL==in)
+    {
+        fprintf(sess->out,"\t%s: cannot open\n",file);
+        return;
+    }
+    enum{KINDS=sizeof(run_tbl)/sizeof(*run_tbl)};
+    long long count[KINDS]={0},ns[KINDS]={0},blocks[KINDS]={0},bytes[KINDS]={0};
+    char *input=NULL,*arena=NULL,cmd[16];
+    size_t cap=0,size=0;
+//exit in the trace ends the replay, not the shell
+    bool was=sess->batch,quit=sess->quit;
+    sess->batch=true;
+    long long total=now_ns();
+    for(ssize_t len;!sess->quit&&-1!=(len=getline(&input,&cap,in));)
     {
-//checks for matching type
-        if(type!=dir->item_type[i])
+        if(size<2*(cap+1))
+        {
+            free(arena);
+            if(NULL==(arena=malloc(size=2*(cap+1))))
+                break;
+        }
+        if(1!=sscanf(input,"%15s",cmd))
             continue;
-//checks for matching name
-        if(!(strcmp(dir->item[i],name)))
+        struct run_cmd *action=find_cmd(cmd);
+        int k=NULL==action?~-KINDS:action-run_tbl;
+        long long t=now_ns(),a=alloc_count,b=touch_bytes;
+        run_line(input,len,arena);
+        ns[k]+=now_ns()-t;
+        blocks[k]+=alloc_count-a;
+        bytes[k]+=touch_bytes-b;
+        count[k]++;
+    }
+    total=now_ns()-total;
+    sess->batch=was;
+    sess->quit=quit;
+    free(input);
+    free(arena);
+    fclose(in);
+//the report follows the commands so that their output does not split it
+    long long n=0;
+    fprintf(sess->out,"\t%-12s %10s %10s %10s %10s\n","command","count","ns/op","blocks/op","bytes/op");
+    for(int k=0;k<KINDS;k++)
+        if(count[k])
         {
-            free(dir);
-            return true;
+            fprintf(sess->out,"\t%-12s %10lld %10lld %10.2f %10.0f\n",NULL==run_tbl[k].cmd?"(unknown)":run_tbl[k].cmd,count[k],ns[k]/count[k],(double)blocks[k]/count[k],(double)bytes[k]/count[k]);
+            n+=count[k];
+        }
+    fprintf(sess->out,"\t%lld commands in %.3f s, %.0f commands/s\n",n,total/1e9,n/(total>0?total/1e9:1e-9));
+}
+
+//every session works in a directory of its own, so sessions meet only at the allocator, the caches and the journal
+void bench_threads(int n)
+{
+    if(sess->alone)
+    {
+        fprintf(sess->out,"\tbench: threads cannot be run from a command which runs alone\n");
+        return;
+    }
+    struct bench_job job[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+    int was=sess->working,home=-1;
+    bool held=disk_lock(CMD_ALONE,NULL),ok=!ch_exist(sess->working,"_bench",true)&&make_dir("_bench","");
+    if(ok)
+        sess->working=home=lookup(was,"_bench",true);
+    for(int t=0;ok&&t<MAX_THREADS;t++)
+    {
+        snprintf(job[t].name,sizeof(job[t].name),"t%d",t);
+        ok=make_dir(job[t].name,"")&&-1!=(job[t].dir=lookup(home,job[t].name,true));
+        job[t].n=n;
+    }
+    sess->working=was;
+    if(held)
+        disk_unlock(CMD_ALONE,-1);
+    if(!ok)
+        fprintf(sess->out,"\tbench: cannot create directory _bench\n");
+    else
+    {
+        double base=0;
+        fprintf(sess->out,"\t%-8s %12s %10s\n","threads","commands/s","speedup");
+        for(int k=1;k<=MAX_THREADS;k<<=1)
+        {
+            long long t=now_ns();
+            int m=0;
+            while(m<k&&!pthread_create(&tid[m],NULL,bench_worker,&job[m]))
+                m++;
+            for(int i=0;i<m;i++)
+                pthread_join(tid[i],NULL);
+            double rate=(double)n*m/((now_ns()-t)/1e9);
+            if(1==k)
+                base=rate;
+            fprintf(sess->out,"\t%-8d %12.0f %10.2f\n",m,rate,base?rate/base:0);
+            if(m<k)
+                break;
         }
     }
-    free(dir);
-    return false;
+    held=disk_lock(CMD_ALONE,NULL);
+    if(-1!=home)
+        rm_dir("_bench","");
+    if(held)
+        disk_unlock(CMD_ALONE,-1);
+}
+
+//half of the commands are ls and the rest mkfil and cd by whole path, each of them locking as typed in a shell
+void *bench_worker(void *arg)
+{
+    struct bench_job *job=arg;
+    struct session s;
+    char *input=NULL,*arena=NULL;
+    FILE *out=fopen("/dev/null","w");
+    if(NULL==out||!session_open(&s,out,true))
+    {
+        if(NULL!=out)
+            fclose(out);
+        return NULL;
+    }
+    sess=&s;
+    disk_lock(CMD_SHARED,NULL);
+    path_set(job->dir);
+    disk_unlock(CMD_SHARED,-1);
+//the path of the session, quoted as in bench_path, is the longest line it runs
+    int home=s.path.end[s.path.depth-1];
+    if(NULL!=(input=malloc(home+16))&&NULL!=(arena=malloc(2*(home+17))))
+        for(int k=0;k<job->n;k++)
+        {
+            int len;
+            if(k&1)
+                len=sprintf(input,"ls");
+            else if(k&2)
+                len=sprintf(input,"mkfil f%d 0",k>>2&63);
+            else
+                len=sprintf(input,"cd \"%.*s\"",home,s.path.prompt);
+            run_line(input,len,arena);
+        }
+    free(input);
+    free(arena);
+    session_close(&s);
+    fclose(out);
+    sess=NULL;
+    return NULL;
+}
+
+//prints one line of a benchmark table
+void bench_row(char *op,long long n,long long t,long long a,long long b)
+{
+    if(!n)
+        n=1;
+    fprintf(sess->out,"\t%-12s %10lld %10.2f %10.0f\n",op,(now_ns()-t)/n,(double)(alloc_count-a)/n,(double)(touch_bytes-b)/n);
+}
+
+//a path has to reach the commands tokenized, as typed, so that they can resolve it name by name; it is quoted since
+//names may hold spaces
+bool bench_path(char *tail,struct line *line,char **text)
+{
+    int len=sess->path.end[sess->path.depth-1];
+    size_t n=len+strlen(tail)+6;
+    if(NULL==(*text=malloc(3*n+2)))
+        return false;
+    int k=sprintf(*text,"cd \"%.*s%s\"",len,sess->path.prompt,tail);
+    return tokenize(*text,k,line,*text+n);
 }
 
+//histogram update is a few atomic additions so that timing can stay on
+void stats_record(int cmd,long long ns)
+{
+    struct cmd_stats *c=&cmd_time[cmd];
+    count(&c->count,1);
+    count(&c->total,ns);
+    count(&c->hist[stats_bucket(ns)],1);
+    for(long long max=__atomic_load_n(&c->max,__ATOMIC_RELAXED);ns>max&&!__atomic_compare_exchange_n(&c->max,&max,ns,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED););
+}
 
-//deletes file from the filesystem
-bool del_file(char *name,char *dir)
+//values below 1<<STATS_SUB_BITS have a bucket each; above, the leading bit picks a group and the next STATS_SUB_BITS bits the bucket
+int stats_bucket(long long ns)
 {
-    struct file *fp=malloc(BLOCKSIZE);
-    int block_index=find_block(name,dir,false);
-    memcpy(fp,disk+block_index*BLOCKSIZE,BLOCKSIZE);
-//deallocate all data blocks
-    for(int i=~-(fp->data_block_count);~i;i--)
-        if(!dealloc_block(fp->data_block[i]))
+    if(ns<1<<STATS_SUB_BITS)
+        return 0>ns?0:ns;
+    int e=63-__builtin_clzll(ns);
+    return ((e-STATS_SUB_BITS+1)<<STATS_SUB_BITS)+(int)(ns>>(e-STATS_SUB_BITS)&~-(1<<STATS_SUB_BITS));
+}
+
+long long stats_value(int b)
+{
+    if(b<1<<STATS_SUB_BITS)
+        return b;
+    int shift=(b>>STATS_SUB_BITS)-1;
+    return ((long long)((1<<STATS_SUB_BITS)+(b&~-(1<<STATS_SUB_BITS)))<<shift)+~-(1LL<<shift);
+}
+
+//walks the buckets up to the run of rank fraction*count rounded up; the top of that bucket is reported, but never above the largest run
+long long stats_percentile(struct cmd_stats *c,double fraction)
+{
+    long long rank=(long long)(fraction*c->count),seen=0;
+    if(rank<fraction*c->count||!rank)
+        rank++;
+    for(int b=0;b<STATS_BUCKETS;b++)
+        if((seen+=c->hist[b])>=rank)
+            return stats_value(b)<c->max?stats_value(b):c->max;
+    return c->max;
+}
+
+void stats_table(FILE *out)
+{
+    fprintf(out,"\t%-8s %8s %10s %10s %10s %10s %10s %10s\n","command","count","mean(ns)","p50","p90","p99","p99.9","max");
+    for(int i=0;NULL!=run_tbl[i].cmd;i++)
+    {
+        struct cmd_stats *c=&cmd_time[i];
+        if(c->count)
+            fprintf(out,"\t%-8s %8lld %10lld %10lld %10lld %10lld %10lld %10lld\n",run_tbl[i].cmd,c->count,c->total/c->count,
+                stats_percentile(c,0.5),stats_percentile(c,0.9),stats_percentile(c,0.99),stats_percentile(c,0.999),c->max);
+    }
+}
+
+//the same numbers as the stats command; percentiles are in nanoseconds
+void stats_dump(FILE *out)
+{
+    fprintf(out,"{\"counters\":{\"find_block\":%lld,\"find_scanned\":%lld,\"alloc_block\":%lld,\"blocks_allocated\":%lld,"
+        "\"dealloc_block\":%lld,\"bytes_copied\":%lld,\"bytes_changed\":%lld},\n\"commands\":{",
+        find_calls,find_scanned,alloc_calls,alloc_count,dealloc_calls,copy_bytes,touch_bytes);
+    for(int i=0,first=1;NULL!=run_tbl[i].cmd;i++)
+    {
+        struct cmd_stats *c=&cmd_time[i];
+        if(!c->count)
+            continue;
+        fprintf(out,"%s\n\"%s\":{\"count\":%lld,\"total\":%lld,\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"p999\":%lld,\"max\":%lld}",
+            first?"":",",run_tbl[i].cmd,c->count,c->total,stats_percentile(c,0.5),stats_percentile(c,0.9),
+            stats_percentile(c,0.99),stats_percentile(c,0.999),c->max);
+        first=0;
+    }
+    fprintf(out,"}}\n");
+}
+
+//counters are only added to, so they need no lock of their own
+void count(long long *c,long long n)
+{
+    __atomic_fetch_add(c,n,__ATOMIC_RELAXED);
+}
+
+//an epoll loop accepts connections and hands those with input to the workers; a connection is armed for one event at
+//a time (EPOLLONESHOT), so the worker which takes it owns it until it arms it again
+bool serve(char *path,int workers)
+{
+    struct sigaction sa={0};
+    sa.sa_handler=serve_stop;
+    sigaction(SIGINT,&sa,NULL);
+    sigaction(SIGTERM,&sa,NULL);
+//signals reach the loop only while it waits, so that a stop cannot come between checking serve_done and waiting
+    sigset_t block,old;
+    sigemptyset(&block);
+    sigaddset(&block,SIGINT);
+    sigaddset(&block,SIGTERM);
+    pthread_sigmask(SIG_BLOCK,&block,&old);
+    int lfd=sock_open(path,true);
+    struct epoll_event ev={.events=EPOLLIN,.data.ptr=NULL},events[SERVE_EVENTS];
+    if(-1==lfd||-1==(serve_epoll=epoll_create1(EPOLL_CLOEXEC))||-1==epoll_ctl(serve_epoll,EPOLL_CTL_ADD,lfd,&ev))
+    {
+        fprintf(sess->out,"\t%s: cannot listen\n",path);
+        pthread_sigmask(SIG_SETMASK,&old,NULL);
+        return false;
+    }
+    pthread_t tid[MAX_THREADS];
+    int m=0;
+    while(m<workers&&m<MAX_THREADS&&!pthread_create(&tid[m],NULL,serve_worker,NULL))
+        m++;
+    fprintf(sess->out,"\tlistening on %s with %d workers\n",path,m);
+    fflush(sess->out);
+    while(!serve_done)
+    {
+        int n=epoll_pwait(serve_epoll,events,SERVE_EVENTS,-1,&old);
+        for(int i=0;i<n;i++)
         {
-            free(fp);
-            return false;
+            struct conn *c=events[i].data.ptr;
+            if(NULL==c)
+            {
+                serve_accept(lfd);
+                continue;
+            }
+            pthread_mutex_lock(&ready_mx);
+            c->next=NULL;
+            if(NULL==ready_tail)
+                ready_head=c;
+            else
+                ready_tail->next=c;
+            ready_tail=c;
+            pthread_cond_signal(&ready_cv);
+            pthread_mutex_unlock(&ready_mx);
         }
-//deallocate block for file
-    if(!dealloc_block(block_index))
+    }
+//connections still open are left to the end of the process; what their commands changed is committed by unmount
+    pthread_mutex_lock(&ready_mx);
+    serve_end=true;
+    pthread_cond_broadcast(&ready_cv);
+    pthread_mutex_unlock(&ready_mx);
+    for(int i=0;i<m;i++)
+        pthread_join(tid[i],NULL);
+    close(lfd);
+    unlink(path);
+    close(serve_epoll);
+    pthread_sigmask(SIG_SETMASK,&old,NULL);
+    fprintf(sess->out,"\tserver stopped\n");
+    return true;
+}
+
+void serve_accept(int lfd)
+{
+    for(int fd;-1!=(fd=accept(lfd,NULL,NULL));)
+    {
+        struct conn *c=calloc(1,sizeof(struct conn));
+        struct epoll_event ev={.events=EPOLLIN|EPOLLONESHOT,.data.ptr=c};
+        if(-1==fcntl(fd,F_SETFL,O_NONBLOCK|fcntl(fd,F_GETFL))||NULL==c||NULL==(c->out=open_memstream(&c->out_buf,&c->out_size))||!session_open(&c->s,c->out,true))
+        {
+            if(NULL!=c&&NULL!=c->out)
+                fclose(c->out);
+            if(NULL!=c)
+                free(c->out_buf);
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd=fd;
+        if(-1==epoll_ctl(serve_epoll,EPOLL_CTL_ADD,fd,&ev))
+            serve_close(c);
+    }
+}
+
+void *serve_worker(void *arg)
+{
+    for(;;)
+    {
+        pthread_mutex_lock(&ready_mx);
+        while(NULL==ready_head&&!serve_end)
+            pthread_cond_wait(&ready_cv,&ready_mx);
+        struct conn *c=ready_head;
+        if(NULL!=c&&NULL==(ready_head=c->next))
+            ready_tail=NULL;
+        pthread_mutex_unlock(&ready_mx);
+        if(NULL==c)
+            return NULL;
+        sess=&c->s;
+        struct epoll_event ev={.events=EPOLLIN|EPOLLONESHOT,.data.ptr=c};
+        bool ok=serve_conn(c);
+//arming under ready_mx orders what this worker did before whatever the next worker to take the connection does
+        if(ok)
+        {
+            pthread_mutex_lock(&ready_mx);
+            ok=-1!=epoll_ctl(serve_epoll,EPOLL_CTL_MOD,c->fd,&ev);
+            pthread_mutex_unlock(&ready_mx);
+        }
+        if(!ok)
+            serve_close(c);
+        sess=NULL;
+    }
+}
+
+//one read per event keeps connections taking turns; every complete line is run and the replies go out in one write
+bool serve_conn(struct conn *c)
+{
+    if(c->in_cap-c->in_len<INPUTSIZE)
+    {
+        size_t cap=c->in_cap?2*c->in_cap:4096;
+        char *in=realloc(c->in,cap),*arena;
+        if(NULL!=in)
+            c->in=in;
+        if(NULL==in||NULL==(arena=realloc(c->arena,2*(cap+1))))
+            return false;
+        c->arena=arena;
+        c->in_cap=cap;
+    }
+    ssize_t n=read(c->fd,c->in+c->in_len,c->in_cap-c->in_len);
+    if(0<n)
+        c->in_len+=n;
+    else if(!n)
+        c->eof=true;
+    else if(EAGAIN!=errno&&EWOULDBLOCK!=errno&&EINTR!=errno)
+        return false;
+    char *p=c->in,*end=c->in+c->in_len,*nl;
+    c->reply_len=0;
+    while(!c->s.quit&&p<end&&(NULL!=(nl=memchr(p,'\n',end-p))||(c->eof&&(nl=end-1))))
     {
-        free(fp);
+//output of the command replaces that of the previous one
+        char head[24];
+        rewind(c->out);
+        run_line(p,nl-p+1,c->arena);
+        fflush(c->out);
+        int k=sprintf(head,"%zu\n",c->out_size);
+        if(!buf_put(&c->reply,&c->reply_len,&c->reply_cap,head,k)||!buf_put(&c->reply,&c->reply_len,&c->reply_cap,c->out_buf,c->out_size))
+            return false;
+        p=nl+1;
+    }
+    memmove(c->in,p,end-p);
+    c->in_len=end-p;
+    if(c->reply_len&&!send_all(c->fd,c->reply,c->reply_len))
         return false;
+    return !c->eof&&!c->s.quit;
+}
+
+//closing the socket also takes it out of the epoll
+void serve_close(struct conn *c)
+{
+    close(c->fd);
+    session_close(&c->s);
+    fclose(c->out);
+    free(c->out_buf);
+    free(c->in);
+    free(c->arena);
+    free(c->reply);
+    free(c);
+}
+
+void serve_stop(int sig)
+{
+    serve_done=1;
+}
+
+bool buf_put(char **buf,size_t *len,size_t *cap,char *data,size_t n)
+{
+    if(*len+n>*cap)
+    {
+        size_t size=*cap?*cap:1024;
+        while(size<*len+n)
+            size<<=1;
+        char *b=realloc(*buf,size);
+        if(NULL==b)
+            return false;
+        *buf=b;
+        *cap=size;
     }
-    free(fp);
+    memcpy(*buf+*len,data,n);
+    *len+=n;
     return true;
 }
 
-//delete directory from the filesystem
-bool del_dir(char *name,char *parent)
+//a slow reader holds up only the worker sending to it
+bool send_all(int fd,char *buf,size_t n)
 {
-    struct folder *dir=malloc(BLOCKSIZE);
-    int block_index=find_block(name,parent,true);
-    memcpy(dir,disk+block_index*BLOCKSIZE,BLOCKSIZE);
-//delete subitems recursively
-    for(int i=~-(dir->item_count);~i;i--)
-        if(dir->item_type[i])
-            if(!del_dir(dir->item[i],name))
-            {
-                free(dir);
+    while(n)
+    {
+        ssize_t k=send(fd,buf,n,MSG_NOSIGNAL);
+        if(0<k)
+        {
+            buf+=k;
+            n-=k;
+            continue;
+        }
+        struct pollfd p={fd,POLLOUT,0};
+        if(-1==k&&EINTR!=errno&&((EAGAIN!=errno&&EWOULDBLOCK!=errno)||(-1==poll(&p,1,-1)&&EINTR!=errno)))
+            return false;
+    }
+    return true;
+}
+
+//the socket is made non-blocking once connected; a socket file left by a server which did not stop is replaced
+int sock_open(char *path,bool server)
+{
+    struct sockaddr_un addr={.sun_family=AF_UNIX};
+    struct stat st;
+    if(strlen(path)>=sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path,path);
+    int fd=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+    if(-1==fd)
+        return -1;
+    if(server&&!stat(path,&st)&&S_ISSOCK(st.st_mode))
+        unlink(path);
+    if((server?-1==bind(fd,(struct sockaddr *)&addr,sizeof(addr))||-1==listen(fd,SOMAXCONN):-1==connect(fd,(struct sockaddr *)&addr,sizeof(addr)))
+        ||-1==fcntl(fd,F_SETFL,O_NONBLOCK|fcntl(fd,F_GETFL)))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//every connection runs the whole script after making its own directory; up to depth commands are written before
+//their replies are read, so what is measured is the server and not the round trip
+bool run_client(char *path,int conns,int depth)
+{
+    char **cmd=NULL,*input=NULL,word[16];
+    int n=2,cap=0,*kind=NULL;
+    size_t size=0;
+//first word of each line picks the run_tbl entry its latency is counted for; lines without a word get no reply worth timing
+    for(ssize_t len;-1!=(len=getline(&input,&size,stdin));)
+    {
+        if(1!=sscanf(input,"%15s",word))
+            continue;
+        if(n>=cap)
+        {
+            cap=cap?2*cap:64;
+            char **c=realloc(cmd,cap*sizeof(char *));
+            int *k=realloc(kind,cap*sizeof(int));
+            if(NULL!=c)
+                cmd=c;
+            if(NULL!=k)
+                kind=k;
+            if(NULL==c||NULL==k)
                 return false;
-            }
-            else
+        }
+        struct run_cmd *action=find_cmd(word);
+        kind[n]=NULL==action?(int)(sizeof(run_tbl)/sizeof(*run_tbl))-1:action-run_tbl;
+        if(NULL==(cmd[n]=malloc(len+2)))
+            return false;
+        sprintf(cmd[n++],"%s%s",input,'\n'==input[len-1]?"":"\n");
+    }
+    free(input);
+    if(2==n)
+    {
+        fprintf(sess->out,"\tno commands\n");
+        return false;
+    }
+    kind[0]=find_cmd("mkdir")-run_tbl;
+    kind[1]=find_cmd("cd")-run_tbl;
+    struct client *cl=calloc(conns,sizeof(struct client));
+    struct pollfd *pf=calloc(conns,sizeof(struct pollfd));
+    if(NULL==cl||NULL==pf)
+        return false;
+    int active=0;
+    for(int i=0;i<conns;i++)
+    {
+        cl[i].need=-1;
+        if(-1==(cl[i].fd=sock_open(path,false))||NULL==(cl[i].sent=malloc(depth*sizeof(long long))))
+        {
+            fprintf(sess->out,"\t%s: cannot connect\n",path);
+            conns=i;
+            break;
+        }
+        active++;
+    }
+    long long t=now_ns(),replies=0;
+    while(active)
+    {
+        for(int i=0;i<conns;i++)
+        {
+            struct client *c=&cl[i];
+            pf[i].fd=c->fd;
+            pf[i].events=0;
+            if(-1==c->fd)
                 continue;
-        else
-            if(!del_file(dir->item[i],name))
+            for(char head[64];c->next<n&&c->next-c->done<depth;c->next++)
             {
-                free(dir);
-                return false;
+                char *text=cmd[c->next];
+                if(2>c->next)
+                    sprintf(text=head,"%s c%d\n",c->next?"cd":"mkdir",i);
+                if(!buf_put(&c->out,&c->out_len,&c->out_cap,text,strlen(text)))
+                    return false;
+                c->sent[c->next%depth]=now_ns();
             }
-            else
+            ssize_t k=c->out_len?send(c->fd,c->out,c->out_len,MSG_NOSIGNAL|MSG_DONTWAIT):0;
+            if(0<k)
+                memmove(c->out,c->out+k,c->out_len-=k);
+            pf[i].events=POLLIN|(c->out_len?POLLOUT:0);
+        }
+        if(-1==poll(pf,conns,-1)&&EINTR!=errno)
+            break;
+        for(int i=0;i<conns;i++)
+        {
+            struct client *c=&cl[i];
+            if(-1==c->fd||!(pf[i].revents&(POLLIN|POLLHUP|POLLERR)))
                 continue;
-//deallocate the block
-    if(!dealloc_block(block_index))
+            int was=c->done;
+            bool ok=client_read(c,kind,depth);
+            replies+=c->done-was;
+            if(ok&&c->done<n)
+                continue;
+            if(c->done<n)
+                fprintf(sess->out,"\tconnection %d ended after %d of %d replies\n",i,c->done,n);
+            close(c->fd);
+            c->fd=-1;
+            active--;
+        }
+    }
+    t=now_ns()-t;
+    if(conns)
     {
-        free(dir);
-        return false;
+        fprintf(sess->out,"\t%d connections, %lld commands in %.3f s, %.0f commands/s\n",conns,replies,t/1e9,replies/(t>0?t/1e9:1e-9));
+        stats_table(sess->out);
+    }
+    for(int i=0;i<conns;i++)
+    {
+        free(cl[i].sent);
+        free(cl[i].out);
     }
-    free(dir);
+    for(int i=2;i<n;i++)
+        free(cmd[i]);
+    free(cmd);
+    free(kind);
+    free(cl);
+    free(pf);
     return true;
 }
 
+//a reply is the length of the output in decimal and '\n' followed by the output; only its arrival matters here
+bool client_read(struct client *c,int *kind,int depth)
+{
+    char buf[1<<16];
+    ssize_t n=recv(c->fd,buf,sizeof(buf),MSG_DONTWAIT);
+    if(-1==n)
+        return EAGAIN==errno||EWOULDBLOCK==errno||EINTR==errno;
+    long long t=now_ns();
+    for(ssize_t i=0;i<n;)
+    {
+        if(-1==c->need)
+        {
+            if('0'<=buf[i]&&'9'>=buf[i])
+            {
+                c->len=c->len*10+buf[i++]-'0';
+                continue;
+            }
+            if('\n'!=buf[i++])
+                return false;
+            c->need=c->len;
+            c->len=0;
+        }
+        long long k=n-i<c->need?n-i:c->need;
+        i+=k;
+        if(c->need-=k)
+            continue;
+        stats_record(kind[c->done],t-c->sent[c->done%depth]);
+        c->done++;
+        c->need=-1;
+    }
+    return 0<n;
+}